@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ray.h"
+#include "trace_stats.h"
 
 
 class aabb {
@@ -26,27 +27,84 @@ public:
         return maximum;
     }
 
+    [[nodiscard]]
+    float surface_area() const {
+        auto d = maximum - minimum;
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
     Bool hit(
         const ray &r,
         Float t_min,
         Float t_max,
         UInt &seed
     ) const {
+        return hit(def(minimum), def(maximum), traversal_ray(r), t_min, t_max);
+    }
+
+    // Slab test against a box whose bounds are only known on the device,
+    // e.g. a node read from a linear_bvh buffer.
+    static Bool hit(
+        const Float3 &box_min,
+        const Float3 &box_max,
+        const traversal_ray &r,
+        const Float &t_min,
+        const Float &t_max
+    ) {
+        Float t_enter;
+        return slab(box_min, box_max, r, t_min, t_max, t_enter);
+    }
+
+    // The slab test of every traversal, which also gives the distance t_enter
+    // at which r enters the box. The sign bits of r pick the entry and exit
+    // bound of each axis, so all three slabs are intersected at once without
+    // branches. A ray grazing the box, entering where it exits, misses it.
+    static Bool slab(
+        const Float3 &box_min,
+        const Float3 &box_max,
+        const traversal_ray &r,
+        const Float &t_min,
+        const Float &t_max,
+        Float &t_enter
+    ) {
+        count_trace(&trace_counters::slab_tests);
+        if (default_slab_test_method == slab_test_method::per_axis) {
+            return slab_per_axis(box_min, box_max, r, t_min, t_max, t_enter);
+        }
+        Float3 t_near = r.slab_distance(ite(r.negative, box_max, box_min));
+        Float3 t_far = r.slab_distance(ite(r.negative, box_min, box_max));
+        t_enter = luisa::compute::max(luisa::compute::max(t_near.x, t_near.y), luisa::compute::max(t_near.z, t_min));
+        Float t_exit = luisa::compute::min(luisa::compute::min(t_far.x, t_far.y), luisa::compute::min(t_far.z, t_max));
+        return t_enter < t_exit;
+    }
+
+private:
+    // The slab test before traversal_ray, kept for --bench-traversal.
+    static Bool slab_per_axis(
+        const Float3 &box_min,
+        const Float3 &box_max,
+        const traversal_ray &r,
+        const Float &t_min,
+        const Float &t_max,
+        Float &t_enter
+    ) {
         Bool ret { true };
+        t_enter = t_min;
+        Float t_exit = t_max;
 
         for (std::size_t i = 0; i < 3; ++i) {
             $if (ret) {
-                auto invD = 1.0f / r.direction()[i];
-                auto t0 = (def(min()[i]) - r.origin()[i]) * invD;
-                auto t1 = (def(max()[i]) - r.origin()[i]) * invD;
-                $if (invD < 0.0f) {
-                    auto tmp = t0;
+                Float inv_d = 1.0f / r.direction[i];
+                Float t0 = (box_min[i] - r.origin[i]) * inv_d;
+                Float t1 = (box_max[i] - r.origin[i]) * inv_d;
+                $if (inv_d < 0.0f) {
+                    Float tmp = t0;
                     t0 = t1;
                     t1 = tmp;
                 };
-                t_min = luisa::compute::max(t0, t_min);
-                t_max = luisa::compute::min(t1, t_max);
-                $if (t_max <= t_min) {
+                t_enter = luisa::compute::max(t0, t_enter);
+                t_exit = luisa::compute::min(t1, t_exit);
+                $if (t_exit <= t_enter) {
                     ret = false;
                 };
             };
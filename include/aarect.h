@@ -2,6 +2,7 @@
 
 #include "rtweekend.h"
 #include "hittable.h"
+#include "primitive.h"
 
 
 class xy_rect : public hittable {
@@ -45,6 +46,16 @@ public:
         return true;
     }
 
+    Bool occluded(const ray &r, Float t_min, Float t_max, UInt &seed) const override {
+        Float t;
+        return primitive_table::hit_rect(def(rect_data { x0, x1, y0, y1, k, 2u, mat_id }), r, t_min, t_max, t);
+    }
+
+    bool pack(primitive_table &table, luisa::vector<uint> &refs) const override {
+        refs.push_back(table.add(rect_data { x0, x1, y0, y1, k, 2u, mat_id }));
+        return true;
+    }
+
 public:
     uint mat_id{};
     shared_ptr<material> mp;
@@ -131,6 +142,16 @@ public:
         return true;
     }
 
+    Bool occluded(const ray &r, Float t_min, Float t_max, UInt &seed) const override {
+        Float t;
+        return primitive_table::hit_rect(def(rect_data { y0, y1, z0, z1, k, 0u, mat_id }), r, t_min, t_max, t);
+    }
+
+    bool pack(primitive_table &table, luisa::vector<uint> &refs) const override {
+        refs.push_back(table.add(rect_data { y0, y1, z0, z1, k, 0u, mat_id }));
+        return true;
+    }
+
 public:
     uint mat_id{};
     shared_ptr<material> mp;
@@ -217,6 +238,16 @@ public:
         return true;
     }
 
+    Bool occluded(const ray &r, Float t_min, Float t_max, UInt &seed) const override {
+        Float t;
+        return primitive_table::hit_rect(def(rect_data { x0, x1, z0, z1, k, 1u, mat_id }), r, t_min, t_max, t);
+    }
+
+    bool pack(primitive_table &table, luisa::vector<uint> &refs) const override {
+        refs.push_back(table.add(rect_data { x0, x1, z0, z1, k, 1u, mat_id }));
+        return true;
+    }
+
 public:
     uint mat_id{};
     shared_ptr<material> mp;
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <luisa/runtime/rtx/accel.h>
+#include <luisa/runtime/rtx/mesh.h>
+#include <luisa/runtime/rtx/procedural_primitive.h>
+#include <luisa/core/stl/unordered_map.h>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "primitive.h"
+#include "bvh.h"
+#include "instance.h"
+
+#include <array>
+
+
+struct accel_instance {
+    float4x4 object_to_world;
+    float4x4 world_to_object;
+    uint offset;// mesh: first rect of the instance, procedural: first entry in procedural_refs
+};
+
+LUISA_STRUCT(accel_instance, object_to_world, world_to_object, offset) {};
+
+
+// The scene mapped onto the backend's acceleration structure: rects and boxes
+// become triangle meshes, spheres, moving spheres and any other hittable become
+// procedural primitives, and translate/rotate_y chains and instances become
+// instance transforms. The geometry of a BVH is built once and shared by all
+// of its instances. Primitive data stays in a primitive_table in object space
+// and is looked up by instance and primitive index.
+class accel_world : public hittable {
+public:
+    accel_world(Device &device, Stream &stream, const hittable_list &world);
+
+    Bool hit(
+        const ray &r,
+        Float t_min,
+        Float t_max,
+        hit_record &rec,
+        UInt &seed
+    ) const override;
+
+    Bool occluded(
+        const ray &r,
+        Float t_min,
+        Float t_max,
+        UInt &seed
+    ) const override;
+
+    bool bounding_box(aabb &output_box) const override {
+        return false;
+    }
+
+private:
+    // A mesh or procedural primitive, placed relative to the group it was
+    // built for.
+    struct geometry {
+        bool mesh;
+        uint resource;// index into meshes or procedurals
+        uint offset;
+        float4x4 transform;
+    };
+
+    void add_group(const primitive_table &group, const float4x4 &transform, luisa::vector<geometry> &geometries);
+    void add_object(const shared_ptr<hittable> &object, const float4x4 &transform, luisa::vector<geometry> &geometries);
+    void add_bvh(const linear_bvh &bvh, const float4x4 &transform, luisa::vector<geometry> &geometries);
+    geometry add_mesh(const luisa::vector<rect_data> &rects, const float4x4 &transform);
+    geometry add_procedural(const luisa::vector<uint> &refs, const float4x4 &transform);
+    void add_instance(uint offset, const float4x4 &transform);
+
+    static ray to_object(const ray &r, const Var<accel_instance> &instance) {
+        return {
+            (instance.world_to_object * make_float4(r.origin(), 1.0f)).xyz(),
+            (instance.world_to_object * make_float4(r.direction(), 0.0f)).xyz(),
+            r.time()
+        };
+    }
+
+public:
+    Device &device;
+    Stream &stream;
+    Accel accel;
+    primitive_table table;
+    luisa::vector<uint> procedural_refs;
+    luisa::vector<accel_instance> instances;
+    luisa::vector<Buffer<float3>> vertex_buffers;
+    luisa::vector<Buffer<Triangle>> triangle_buffers;
+    luisa::vector<Buffer<AABB>> aabb_buffers;
+    luisa::vector<Mesh> meshes;
+    luisa::vector<ProceduralPrimitive> procedurals;
+    luisa::unordered_map<const linear_bvh *, luisa::vector<geometry>> bvh_geometries;
+    Buffer<uint> procedural_ref_buffer;
+    Buffer<accel_instance> instance_buffer;
+};
+
+accel_world::accel_world(Device &device, Stream &stream, const hittable_list &world)
+    : device(device)
+    , stream(stream)
+    , accel(device.create_accel())
+{
+    primitive_table group;
+    luisa::vector<uint> refs;
+    world.pack(group, refs);
+
+    luisa::vector<geometry> geometries;
+    add_group(group, make_float4x4(1.0f), geometries);
+    for (const auto &g : geometries) {
+        if (g.mesh) {
+            accel.emplace_back(meshes[g.resource], g.transform);
+        } else {
+            accel.emplace_back(procedurals[g.resource], g.transform);
+        }
+        add_instance(g.offset, g.transform);
+    }
+
+    table.upload(device, stream);
+    instance_buffer = device.create_buffer<accel_instance>(instances.size());
+    stream << instance_buffer.copy_from(instances.data());
+    if (!procedural_refs.empty()) {
+        procedural_ref_buffer = device.create_buffer<uint>(procedural_refs.size());
+        stream << procedural_ref_buffer.copy_from(procedural_refs.data());
+    }
+    stream << accel.build() << synchronize();
+
+    LUISA_INFO(
+        "Accel: {} instances, {} meshes ({} rects), {} procedural primitives.",
+        instances.size(),
+        meshes.size(),
+        table.rects.size(),
+        procedural_refs.size()
+    );
+}
+
+void accel_world::add_group(
+    const primitive_table &group,
+    const float4x4 &transform,
+    luisa::vector<geometry> &geometries
+) {
+    if (!group.rects.empty()) {
+        geometries.push_back(add_mesh(group.rects, transform));
+    }
+
+    luisa::vector<uint> refs;
+    for (const auto &s : group.spheres) {
+        refs.push_back(table.add(s));
+    }
+    for (const auto &s : group.moving_spheres) {
+        refs.push_back(table.add(s));
+    }
+
+    for (const auto &inst : group.instances) {
+        add_object(group.blas_objects[inst.blas], transform * to_float4x4(inst.object_to_world), geometries);
+    }
+
+    for (const auto &object : group.customs) {
+        // Unwrap transforms and nested BVHs, anything else is intersected by
+        // its own hit() from the procedural candidate callback.
+        if (auto t = dynamic_cast<const translate *>(object.get())) {
+            add_object(t->ptr, transform * translation(t->offset), geometries);
+        } else if (auto r = dynamic_cast<const rotate_y *>(object.get())) {
+            add_object(
+                r->ptr,
+                transform * make_float4x4(
+                    make_float4(r->cos_theta, 0.0f, -r->sin_theta, 0.0f),
+                    make_float4(0.0f, 1.0f, 0.0f, 0.0f),
+                    make_float4(r->sin_theta, 0.0f, r->cos_theta, 0.0f),
+                    make_float4(0.0f, 0.0f, 0.0f, 1.0f)
+                ),
+                geometries
+            );
+        } else if (auto i = dynamic_cast<const instance *>(object.get())) {
+            add_object(i->ptr, transform * i->object_to_world, geometries);
+        } else if (auto bvh = dynamic_cast<const linear_bvh *>(object.get())) {
+            add_bvh(*bvh, transform, geometries);
+        } else {
+            refs.push_back(table.add(object));
+        }
+    }
+
+    if (!refs.empty()) {
+        geometries.push_back(add_procedural(refs, transform));
+    }
+}
+
+void accel_world::add_object(
+    const shared_ptr<hittable> &object,
+    const float4x4 &transform,
+    luisa::vector<geometry> &geometries
+) {
+    primitive_table nested;
+    luisa::vector<uint> nested_refs;
+    pack_hittable(object, nested, nested_refs);
+    add_group(nested, transform, geometries);
+}
+
+void accel_world::add_bvh(
+    const linear_bvh &bvh,
+    const float4x4 &transform,
+    luisa::vector<geometry> &geometries
+) {
+    auto iter = bvh_geometries.find(&bvh);
+    if (iter == bvh_geometries.end()) {
+        luisa::vector<geometry> built;
+        add_group(bvh.table, make_float4x4(1.0f), built);
+        iter = bvh_geometries.emplace(&bvh, std::move(built)).first;
+    }
+
+    for (auto g : iter->second) {
+        g.transform = transform * g.transform;
+        geometries.push_back(g);
+    }
+}
+
+void accel_world::add_instance(uint offset, const float4x4 &transform) {
+    accel_instance instance {};
+    instance.object_to_world = transform;
+    instance.world_to_object = inverse(transform);
+    instance.offset = offset;
+    instances.push_back(instance);
+}
+
+accel_world::geometry accel_world::add_mesh(const luisa::vector<rect_data> &rects, const float4x4 &transform) {
+    luisa::vector<float3> vertices;
+    luisa::vector<Triangle> triangles;
+    auto offset = static_cast<uint>(table.rects.size());
+
+    // Two triangles per rect, so triangle i belongs to rect offset + i / 2.
+    for (const auto &rect : rects) {
+        table.add(rect);
+
+        auto a = rect.axis == 0u ? 1u : 0u;
+        auto b = rect.axis == 2u ? 1u : 2u;
+        auto first = static_cast<uint>(vertices.size());
+        std::array<float2, 4> corners {
+            make_float2(rect.a0, rect.b0),
+            make_float2(rect.a1, rect.b0),
+            make_float2(rect.a1, rect.b1),
+            make_float2(rect.a0, rect.b1)
+        };
+        for (const auto &corner : corners) {
+            float3 vertex {};
+            vertex[rect.axis] = rect.k;
+            vertex[a] = corner.x;
+            vertex[b] = corner.y;
+            vertices.push_back(vertex);
+        }
+        triangles.push_back(Triangle { first, first + 1u, first + 2u });
+        triangles.push_back(Triangle { first, first + 2u, first + 3u });
+    }
+
+    auto &vertex_buffer = vertex_buffers.emplace_back(device.create_buffer<float3>(vertices.size()));
+    auto &triangle_buffer = triangle_buffers.emplace_back(device.create_buffer<Triangle>(triangles.size()));
+    auto &mesh = meshes.emplace_back(device.create_mesh(vertex_buffer, triangle_buffer));
+    stream << vertex_buffer.copy_from(vertices.data())
+        << triangle_buffer.copy_from(triangles.data())
+        << mesh.build();
+
+    return { true, static_cast<uint>(meshes.size() - 1u), offset, transform };
+}
+
+accel_world::geometry accel_world::add_procedural(const luisa::vector<uint> &refs, const float4x4 &transform) {
+    luisa::vector<AABB> aabbs;
+    auto offset = static_cast<uint>(procedural_refs.size());
+
+    for (auto ref : refs) {
+        auto box = table.bounds(ref);
+        aabbs.push_back(AABB {
+            { box.min().x, box.min().y, box.min().z },
+            { box.max().x, box.max().y, box.max().z }
+        });
+        procedural_refs.push_back(ref);
+    }
+
+    auto &aabb_buffer = aabb_buffers.emplace_back(device.create_buffer<AABB>(aabbs.size()));
+    auto &procedural = procedurals.emplace_back(device.create_procedural_primitive(aabb_buffer.view()));
+    stream << aabb_buffer.copy_from(aabbs.data()) << procedural.build();
+
+    return { false, static_cast<uint>(procedurals.size() - 1u), offset, transform };
+}
+
+Bool accel_world::hit(
+    const ray &r,
+    Float t_min,
+    Float t_max,
+    hit_record &rec,
+    UInt &seed
+) const {
+    // Custom primitives fill a full record in the candidate callback; keep the
+    // one of the last (and therefore nearest) commit.
+    hit_record custom_rec;
+
+    Var<CommittedHit> committed = accel->query_all(make_ray(r.origin(), r.direction(), t_min, t_max))
+        .on_surface_candidate([&](SurfaceCandidate &candidate) noexcept {
+            candidate.commit();
+        })
+        .on_procedural_candidate([&](ProceduralCandidate &candidate) noexcept {
+            if (procedural_refs.empty()) {
+                return;
+            }
+            Var<ProceduralHit> h = candidate.hit();
+            Var<accel_instance> instance = instance_buffer->read(h.inst);
+            UInt ref = procedural_ref_buffer->read(instance.offset + h.prim);
+
+            primitive_hit closest { candidate.ray()->t_max() };
+            table.intersect(ref, to_object(r, instance), t_min, closest, seed);
+            $if (closest.prim != invalid_primitive) {
+                custom_rec = closest.custom_rec;
+                candidate.commit(closest.t);
+            };
+        })
+        .trace();
+
+    Bool ret { false };
+    $if (committed.hit_type != static_cast<uint>(HitType::Miss)) {
+        Var<accel_instance> instance = instance_buffer->read(committed.inst);
+        ray object_r = to_object(r, instance);
+
+        primitive_hit closest { committed.committed_ray_t };
+        $if (committed.hit_type == static_cast<uint>(HitType::Surface)) {
+            closest.prim = make_primitive_ref(primitive_type::rect, 0u) | (instance.offset + committed.prim / 2u);
+        } $else {
+            if (!procedural_refs.empty()) {
+                closest.prim = procedural_ref_buffer->read(instance.offset + committed.prim);
+                closest.custom_rec = custom_rec;
+            }
+        };
+
+        // Attributes are resolved in object space; t is shared since the
+        // transformed ray keeps its unnormalized direction.
+        ret = table.resolve(closest, object_r, rec);
+        rec.p = (instance.object_to_world * make_float4(rec.p, 1.0f)).xyz();
+        rec.normal = normalize((transpose(instance.world_to_object) * make_float4(rec.normal, 0.0f)).xyz());
+    };
+
+    return ret;
+}
+
+Bool accel_world::occluded(
+    const ray &r,
+    Float t_min,
+    Float t_max,
+    UInt &seed
+) const {
+    Var<CommittedHit> committed = accel->query_any(make_ray(r.origin(), r.direction(), t_min, t_max))
+        .on_surface_candidate([&](SurfaceCandidate &candidate) noexcept {
+            candidate.commit();
+        })
+        .on_procedural_candidate([&](ProceduralCandidate &candidate) noexcept {
+            if (procedural_refs.empty()) {
+                return;
+            }
+            Var<ProceduralHit> h = candidate.hit();
+            Var<accel_instance> instance = instance_buffer->read(h.inst);
+            UInt ref = procedural_ref_buffer->read(instance.offset + h.prim);
+            $if (table.occluded(ref, to_object(r, instance), t_min, candidate.ray()->t_max(), seed)) {
+                candidate.commit(t_min);
+            };
+        })
+        .trace();
+
+    return committed.hit_type != static_cast<uint>(HitType::Miss);
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include "rtweekend.h"
+
+
+enum struct accumulation_format {
+    mean,        // FLOAT4 running mean, the alpha channel unused
+    sum,         // RGB float sum, divided by the sample count when resolved
+    half,        // HALF4 running mean, for previews
+    kahan,       // RGB sum and its Kahan compensation
+    double_float // RGB sum as unevaluated pairs of floats, hi + lo
+};
+
+accumulation_format default_accumulation_format { accumulation_format::mean };
+
+// The color estimate of a pixel while a kernel adds samples to it, loaded
+// once per dispatch and stored at the end.
+struct accumulation {
+    Float3 value;       // the mean so far, or the sum for the sum formats
+    Float3 compensation;// kahan: the negated bits lost from value; double_float: lo
+    Float count;
+};
+
+// Per-pixel image estimates in one of the accumulation_formats. The running
+// mean rounds every sample into a weight of 1 / n, which loses precision at
+// thousands of samples per pixel; the sum formats divide only when resolved.
+// They keep no count of their own: the caller passes the sample count of the
+// pixel, which is the same for every pixel unless sampling is adaptive.
+class accumulator {
+public:
+    accumulator(Device &device, uint2 resolution, accumulation_format format = default_accumulation_format);
+
+    // The estimate of the pixel at coord, which has sample_index samples so
+    // far, or nothing when sample_index is 0.
+    [[nodiscard]]
+    accumulation load(const UInt2 &coord, const UInt &sample_index) const;
+
+    // Shaders that call add() must be compiled with shader_option().
+    void add(accumulation &acc, const Float3 &color) const;
+
+    void store(const UInt2 &coord, const accumulation &acc) const;
+
+    // The mean color of the pixel at coord, which has sample_count samples.
+    [[nodiscard]]
+    Float3 resolve(const UInt2 &coord, const Float &sample_count) const;
+
+    // Fast math may reassociate the error terms of compensated sums, e.g.
+    // (t - value) - y, to 0, so it is turned off for kahan and double_float.
+    [[nodiscard]]
+    ShaderOption shader_option() const {
+        ShaderOption option;
+        option.enable_fast_math = sum_components() != 6u;
+        return option;
+    }
+
+    [[nodiscard]]
+    uint bytes_per_pixel() const {
+        switch (format) {
+            case accumulation_format::half: return 8u;
+            case accumulation_format::mean: return 16u;
+            default: return sum_components() * 4u;
+        }
+    }
+
+    [[nodiscard]]
+    std::size_t size_bytes() const {
+        return static_cast<std::size_t>(resolution.x) * resolution.y * bytes_per_pixel();
+    }
+
+    [[nodiscard]]
+    const char *name() const {
+        switch (format) {
+            case accumulation_format::sum: return "sum";
+            case accumulation_format::half: return "half";
+            case accumulation_format::kahan: return "kahan";
+            case accumulation_format::double_float: return "double-float";
+            default: return "mean";
+        }
+    }
+
+private:
+    // Floats per pixel in sums: the RGB sum, then for the compensated
+    // formats its second RGB term; 0 for the running means.
+    [[nodiscard]]
+    uint sum_components() const {
+        switch (format) {
+            case accumulation_format::sum: return 3u;
+            case accumulation_format::kahan:
+            case accumulation_format::double_float: return 6u;
+            default: return 0u;
+        }
+    }
+
+    [[nodiscard]]
+    UInt sum_offset(const UInt2 &coord) const {
+        return (coord.y * resolution.x + coord.x) * sum_components();
+    }
+
+    [[nodiscard]]
+    Float3 read_sum(const UInt &offset) const {
+        return make_float3(sums->read(offset), sums->read(offset + 1u), sums->read(offset + 2u));
+    }
+
+    void write_sum(const UInt &offset, const Float3 &v) const {
+        sums->write(offset, v.x);
+        sums->write(offset + 1u, v.y);
+        sums->write(offset + 2u, v.z);
+    }
+
+private:
+    accumulation_format format;
+    uint2 resolution;
+    Image<float> values;// 1x1 unless format is mean or half
+    Buffer<float> sums; // a single float for mean and half
+};
+
+accumulator::accumulator(Device &device, uint2 resolution, accumulation_format format)
+    : format(format)
+    , resolution(resolution)
+{
+    bool is_sum = sum_components() != 0u;
+    values = device.create_image<float>(
+        format == accumulation_format::half ? PixelStorage::HALF4 : PixelStorage::FLOAT4,
+        is_sum ? make_uint2(1u) : resolution,
+        1u,
+        false,
+        false
+    );
+    sums = device.create_buffer<float>(is_sum ? resolution.x * resolution.y * sum_components() : 1u);
+}
+
+accumulation accumulator::load(const UInt2 &coord, const UInt &sample_index) const {
+    accumulation acc {
+        make_float3(0.0f),
+        make_float3(0.0f),
+        cast<Float>(sample_index)
+    };
+    $if (sample_index > 0u) {
+        if (sum_components() == 0u) {
+            acc.value = values->read(coord).xyz();
+        } else {
+            UInt offset = sum_offset(coord);
+            acc.value = read_sum(offset);
+            if (sum_components() == 6u) {
+                acc.compensation = read_sum(offset + 3u);
+            }
+        }
+    };
+    return acc;
+}
+
+void accumulator::add(accumulation &acc, const Float3 &color) const {
+    acc.count += 1.0f;
+    switch (format) {
+        case accumulation_format::sum:
+            acc.value += color;
+            break;
+        case accumulation_format::kahan: {
+            Float3 y = color - acc.compensation;
+            Float3 t = acc.value + y;
+            acc.compensation = (t - acc.value) - y;
+            acc.value = t;
+            break;
+        }
+        case accumulation_format::double_float: {
+            // Knuth's two-sum gives the exact rounding error of hi + color,
+            // which goes into lo before the pair is renormalized.
+            Float3 s = acc.value + color;
+            Float3 v = s - acc.value;
+            Float3 e = (acc.value - (s - v)) + (color - v);
+            Float3 lo = acc.compensation + e;
+            acc.value = s + lo;
+            acc.compensation = lo - (acc.value - s);
+            break;
+        }
+        default:
+            acc.value = lerp(acc.value, color, 1.0f / acc.count);
+            break;
+    }
+}
+
+void accumulator::store(const UInt2 &coord, const accumulation &acc) const {
+    if (sum_components() == 0u) {
+        values->write(coord, make_float4(acc.value, 1.0f));
+        return;
+    }
+    UInt offset = sum_offset(coord);
+    write_sum(offset, acc.value);
+    if (sum_components() == 6u) {
+        write_sum(offset + 3u, acc.compensation);
+    }
+}
+
+Float3 accumulator::resolve(const UInt2 &coord, const Float &sample_count) const {
+    if (sum_components() == 0u) {
+        return values->read(coord).xyz();
+    }
+    UInt offset = sum_offset(coord);
+    Float3 sum = read_sum(offset);
+    switch (format) {
+        case accumulation_format::kahan:
+            sum -= read_sum(offset + 3u);
+            break;
+        case accumulation_format::double_float:
+            sum += read_sum(offset + 3u);
+            break;
+        default:
+            break;
+    }
+    return sum / max(sample_count, 1.0f);
+}
@@ -17,6 +17,14 @@ public:
         return true;
     }
 
+    Bool occluded(const ray &r, Float t_min, Float t_max, UInt &seed) const override {
+        return sides.occluded(r, t_min, t_max, seed);
+    }
+
+    bool pack(primitive_table &table, luisa::vector<uint> &refs) const override {
+        return sides.pack(table, refs);
+    }
+
 public:
     float3 box_min {};
     float3 box_max {};
@@ -3,8 +3,14 @@
 #include "rtweekend.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "primitive.h"
+#include "task_pool.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <limits>
 
 
 class bvh_node : public hittable {
@@ -15,10 +21,29 @@ public:
         : bvh_node(list.objects, 0, list.objects.size())
     {}
 
+    // Builds over a copy of src_objects[start, end).
     bvh_node(
         const vector<shared_ptr<hittable>> &src_objects,
         size_t start,
         size_t end
+    )
+        : bvh_node(vector<shared_ptr<hittable>>(src_objects), start, end)
+    {}
+
+    bvh_node(
+        vector<shared_ptr<hittable>> &&objects,
+        size_t start,
+        size_t end
+    )
+        : bvh_node(objects, start, end)
+    {}
+
+    // Builds over objects[start, end), reordering them in place; the children
+    // are built over the same array.
+    bvh_node(
+        vector<shared_ptr<hittable>> &objects,
+        size_t start,
+        size_t end
     );
 
     virtual Bool hit(
@@ -29,12 +54,24 @@ public:
         UInt &seed
     ) const override;
 
+    Bool occluded(
+        const ray &r,
+        Float t_min,
+        Float t_max,
+        UInt &seed
+    ) const override;
+
     virtual bool bounding_box(aabb &output_box) const override;
 
+    uint features() const override {
+        return left->features() | right->features();
+    }
+
 public:
     shared_ptr<hittable> left;
     shared_ptr<hittable> right;
     aabb box;
+    int axis {};
 };
 
 bool bvh_node::bounding_box(aabb &output_box) const {
@@ -64,6 +101,24 @@ Bool bvh_node::hit(
     return ret;
 }
 
+Bool bvh_node::occluded(
+    const ray &r,
+    Float t_min,
+    Float t_max,
+    UInt &seed
+) const {
+    Bool ret { false };
+
+    $if (box.hit(r, t_min, t_max, seed)) {
+        ret = left->occluded(r, t_min, t_max, seed);
+        $if (!ret) {
+            ret = right->occluded(r, t_min, t_max, seed);
+        };
+    };
+
+    return ret;
+}
+
 inline bool box_compare(
     const shared_ptr<hittable>& a,
     const shared_ptr<hittable>& b,
@@ -92,13 +147,11 @@ bool box_z_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b)
 }
 
 bvh_node::bvh_node(
-    const vector<shared_ptr<hittable>> &src_objects,
+    vector<shared_ptr<hittable>> &objects,
     std::size_t start,
     std::size_t end
 ) {
-    auto objects = src_objects;// Create a modifiable array of the source scene objects
-
-    int axis = random_int(0, 2);
+    axis = random_int(0, 2);
     auto comparator = (axis == 0)
         ? box_x_compare
         : (axis == 1)
@@ -118,9 +171,10 @@ bvh_node::bvh_node(
             right = objects[start];
         }
     } else {
-        std::sort(objects.begin() + start, objects.begin() + end, comparator);
-
+        // Only the median has to be in place for the split.
         auto mid = start + object_span / 2;
+        std::nth_element(objects.begin() + start, objects.begin() + mid, objects.begin() + end, comparator);
+
         left = make_shared<bvh_node>(objects, start, mid);
         right = make_shared<bvh_node>(objects, mid, end);
     }
@@ -133,3 +187,982 @@ bvh_node::bvh_node(
 
     box = surrounding_box(box_left, box_right);
 }
+
+
+// Traversal stack depth of linear_bvh::hit, one entry per level of the tree.
+// Trees deeper than this are rejected when uploaded.
+static constexpr uint bvh_stack_size { 64u };
+
+// Number of centroid bins per axis evaluated by the SAH builder.
+static constexpr uint sah_bin_count { 16u };
+
+// Largest leaf the SAH builder creates when splitting no longer pays off.
+static constexpr uint sah_max_leaf_size { 4u };
+
+// Relative costs of visiting a node and of intersecting a primitive.
+static constexpr float sah_traversal_cost { 1.0f };
+static constexpr float sah_intersection_cost { 1.0f };
+
+// Subtrees over at least this many primitives are built as separate tasks.
+static constexpr std::size_t sah_task_size { 4096u };
+
+// Subtrees of up to this many nodes are refit as one task.
+static constexpr uint refit_task_size { 8192u };
+
+// Refits keep the topology until the SAH cost exceeds this factor times the
+// cost of the last build.
+static constexpr float refit_rebuild_threshold { 1.3f };
+
+enum struct bvh_build_method {
+    median,// bvh_node: random axis, split at the median
+    sah    // binned surface area heuristic
+};
+
+// Builder used by linear_bvh when none is given, selected with --bvh.
+bvh_build_method default_bvh_build_method { bvh_build_method::median };
+
+struct linear_bvh_node {
+    float3 box_min;
+    float3 box_max;
+    uint offset;// leaf: first primitive, interior: index of the second child
+    uint count; // leaf: number of primitives, interior: 0
+    uint axis;  // interior: split axis, used to visit the nearer child first
+};
+
+LUISA_STRUCT(linear_bvh_node, box_min, box_max, offset, count, axis) {};
+
+
+// Branching factor of the nodes linear_bvh traverses: 2 for the binary nodes,
+// or 4 and 8 for wide nodes collapsed from them. Selected with --bvh-width.
+uint default_bvh_width { 2u };
+
+// Traversal stack depth for wide nodes, which push up to width - 1 entries
+// per level. Wide trees that could need more fall back to binary nodes.
+static constexpr uint wide_bvh_stack_size { 128u };
+
+// A child of a wide node is either the index of another wide node or, with
+// the top bit set, a leaf holding its primitive count and first primitive.
+static constexpr uint wide_leaf_flag { 1u << 31u };
+static constexpr uint wide_count_shift { 24u };
+static constexpr uint wide_count_mask { 0x7fu };
+static constexpr uint wide_offset_mask { (1u << wide_count_shift) - 1u };
+
+// A node with up to Width children whose boxes are quantized to 8 bits per
+// bound in the frame of the node box: child i spans origin + lo * scale to
+// origin + hi * scale. The integer bounds are bytes, four to a word and
+// grouped by axis: the bound of child i on an axis is byte i % 4 of word
+// axis * Width / 4 + i / 4.
+template<uint Width>
+struct wide_bvh_node {
+    static_assert(Width % 4u == 0u, "wide nodes pack four bounds per word");
+
+    float3 origin;
+    float3 scale;
+    std::array<uint, 3u * Width / 4u> lo;
+    std::array<uint, 3u * Width / 4u> hi;
+    std::array<uint, Width> child;
+    uint child_count;
+};
+
+using bvh4_node = wide_bvh_node<4u>;
+using bvh8_node = wide_bvh_node<8u>;
+
+LUISA_STRUCT(bvh4_node, origin, scale, lo, hi, child, child_count) {};
+LUISA_STRUCT(bvh8_node, origin, scale, lo, hi, child, child_count) {};
+
+
+// Host threads shared by all BVH builds, started on first use.
+task_pool &bvh_task_pool() {
+    static task_pool pool;
+    return pool;
+}
+
+
+// Binned SAH build over an array of primitive indices that is partitioned in
+// place, so no primitive data moves and subtrees only own a range of the
+// array. Large subtrees are built as tasks of the pool. Nodes are allocated in
+// sibling pairs from an atomic counter while building, then laid out depth
+// first for linear_bvh.
+class sah_builder {
+public:
+    explicit sah_builder(task_pool &pool = bvh_task_pool())
+        : pool(pool)
+    {}
+
+    // Fills nodes with the tree over boxes and order with the box indices in
+    // leaf order; leaf offsets index into order.
+    void build(
+        const luisa::vector<aabb> &boxes,
+        luisa::vector<linear_bvh_node> &nodes,
+        luisa::vector<uint> &order
+    );
+
+private:
+    struct build_node {
+        aabb box;
+        uint start;
+        uint count;      // leaf: number of primitives, interior: 0
+        uint first_child;// interior: index of the left child, the right one follows
+        uint axis;
+    };
+
+    void build_range(uint node, std::size_t start, std::size_t end);
+    uint emit(uint node, luisa::vector<linear_bvh_node> &nodes) const;
+
+private:
+    task_pool &pool;
+    const luisa::vector<aabb> *boxes { nullptr };
+    luisa::vector<float3> centroids;
+    luisa::vector<uint> *order { nullptr };
+    luisa::vector<build_node> build_nodes;
+    std::atomic<uint> node_count { 0u };
+};
+
+void sah_builder::build(
+    const luisa::vector<aabb> &boxes,
+    luisa::vector<linear_bvh_node> &nodes,
+    luisa::vector<uint> &order
+) {
+    if (boxes.empty()) {
+        LUISA_ERROR("No primitives to build a BVH over.\n");
+    }
+
+    this->boxes = &boxes;
+    this->order = &order;
+    order.resize(boxes.size());
+    centroids.resize(boxes.size());
+    for (std::size_t i = 0u; i < boxes.size(); i++) {
+        order[i] = static_cast<uint>(i);
+        centroids[i] = 0.5f * (boxes[i].min() + boxes[i].max());
+    }
+
+    // A binary tree with at least one primitive per leaf has at most 2n - 1 nodes.
+    build_nodes.resize(2u * boxes.size() - 1u);
+    node_count = 1u;
+    build_range(0u, 0u, boxes.size());
+    pool.wait();
+
+    nodes.reserve(nodes.size() + node_count);
+    emit(0u, nodes);
+}
+
+void sah_builder::build_range(uint node, std::size_t start, std::size_t end) {
+    const auto &boxes = *this->boxes;
+    auto &order = *this->order;
+
+    aabb bounds = boxes[order[start]];
+    aabb centroid_bounds(centroids[order[start]], centroids[order[start]]);
+    for (auto i = start + 1u; i < end; i++) {
+        bounds = surrounding_box(bounds, boxes[order[i]]);
+        centroid_bounds = surrounding_box(centroid_bounds, aabb(centroids[order[i]], centroids[order[i]]));
+    }
+
+    auto make_leaf = [&] {
+        build_nodes[node] = { bounds, static_cast<uint>(start), static_cast<uint>(end - start), 0u, 0u };
+    };
+
+    auto object_span = end - start;
+    if (object_span == 1u) {
+        make_leaf();
+        return;
+    }
+
+    // Sweep the bins of every axis for the cheapest split plane.
+    auto best_cost = std::numeric_limits<float>::max();
+    int best_axis = -1;
+    uint best_split = 0u;
+    auto extent = centroid_bounds.max() - centroid_bounds.min();
+    auto bin_of = [&](uint primitive, int axis) {
+        auto offset = (centroids[primitive][axis] - centroid_bounds.min()[axis]) / extent[axis];
+        return std::min(static_cast<uint>(offset * static_cast<float>(sah_bin_count)), sah_bin_count - 1u);
+    };
+
+    for (int axis = 0; axis < 3; axis++) {
+        if (extent[axis] <= 0.0f) {
+            continue;
+        }
+
+        std::array<uint, sah_bin_count> bin_counts {};
+        std::array<aabb, sah_bin_count> bin_boxes {};
+        for (auto i = start; i < end; i++) {
+            auto bin = bin_of(order[i], axis);
+            bin_boxes[bin] = bin_counts[bin] == 0u
+                ? boxes[order[i]]
+                : surrounding_box(bin_boxes[bin], boxes[order[i]]);
+            bin_counts[bin]++;
+        }
+
+        // right_costs[i]: count times area of everything in bins (i, sah_bin_count).
+        std::array<float, sah_bin_count> right_costs {};
+        aabb right_box;
+        uint right_count { 0u };
+        for (auto bin = sah_bin_count - 1u; bin > 0u; bin--) {
+            if (bin_counts[bin] > 0u) {
+                right_box = right_count == 0u ? bin_boxes[bin] : surrounding_box(right_box, bin_boxes[bin]);
+                right_count += bin_counts[bin];
+            }
+            right_costs[bin - 1u] = static_cast<float>(right_count) * right_box.surface_area();
+        }
+
+        aabb left_box;
+        uint left_count { 0u };
+        for (uint bin = 0u; bin + 1u < sah_bin_count; bin++) {
+            if (bin_counts[bin] > 0u) {
+                left_box = left_count == 0u ? bin_boxes[bin] : surrounding_box(left_box, bin_boxes[bin]);
+                left_count += bin_counts[bin];
+            }
+            if (left_count == 0u || left_count == object_span) {
+                continue;
+            }
+            auto cost = static_cast<float>(left_count) * left_box.surface_area() + right_costs[bin];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = bin;
+            }
+        }
+    }
+
+    auto leaf_cost = sah_intersection_cost * static_cast<float>(object_span);
+    auto split_cost = best_axis < 0
+        ? std::numeric_limits<float>::max()
+        : sah_traversal_cost + sah_intersection_cost * best_cost / bounds.surface_area();
+    if (object_span <= sah_max_leaf_size && leaf_cost <= split_cost) {
+        make_leaf();
+        return;
+    }
+
+    std::size_t mid;
+    if (best_axis < 0) {
+        // All centroids coincide, so no plane separates them: split the range in half.
+        best_axis = 0;
+        mid = start + object_span / 2u;
+    } else {
+        auto middle = std::partition(
+            order.begin() + static_cast<std::ptrdiff_t>(start),
+            order.begin() + static_cast<std::ptrdiff_t>(end),
+            [&](uint primitive) {
+                return bin_of(primitive, best_axis) <= best_split;
+            }
+        );
+        mid = static_cast<std::size_t>(middle - order.begin());
+    }
+
+    auto first_child = node_count.fetch_add(2u);
+    build_nodes[node] = { bounds, 0u, 0u, first_child, static_cast<uint>(best_axis) };
+
+    if (mid - start >= sah_task_size) {
+        pool.submit([this, first_child, start, mid] {
+            build_range(first_child, start, mid);
+        });
+    } else {
+        build_range(first_child, start, mid);
+    }
+    build_range(first_child + 1u, mid, end);
+}
+
+uint sah_builder::emit(uint node, luisa::vector<linear_bvh_node> &nodes) const {
+    const auto &source = build_nodes[node];
+    auto index = static_cast<uint>(nodes.size());
+    nodes.emplace_back();
+
+    linear_bvh_node linear {};
+    linear.box_min = source.box.min();
+    linear.box_max = source.box.max();
+    if (source.count > 0u) {
+        linear.offset = source.start;
+        linear.count = source.count;
+    } else {
+        emit(source.first_child, nodes);
+        linear.offset = emit(source.first_child + 1u, nodes);
+        linear.count = 0u;
+        linear.axis = source.axis;
+    }
+    nodes[index] = linear;
+
+    return index;
+}
+
+
+// A bvh tree flattened into a device buffer. The nodes are laid out depth
+// first, so the left child of an interior node directly follows its parent,
+// and hit() walks them with a stack loop instead of recursing at trace time.
+// Leaves reference primitives packed into a primitive_table.
+class linear_bvh : public hittable, public bottom_level {
+public:
+    linear_bvh(
+        Device &device,
+        Stream &stream,
+        const hittable_list &list,
+        bvh_build_method method = default_bvh_build_method
+    );
+
+    linear_bvh(Device &device, Stream &stream, const bvh_node &root);
+
+    Bool hit(
+        const ray &r,
+        Float t_min,
+        Float t_max,
+        hit_record &rec,
+        UInt &seed
+    ) const override;
+
+    Bool occluded(
+        const ray &r,
+        Float t_min,
+        Float t_max,
+        UInt &seed
+    ) const override;
+
+    void intersect(
+        const ray &r,
+        const Float &t_min,
+        primitive_hit &closest,
+        UInt &seed
+    ) const override;
+
+    Bool resolve(const primitive_hit &closest, const ray &r, hit_record &rec) const override {
+        return table.resolve(closest, r, rec);
+    }
+
+    [[nodiscard]]
+    bool has_instances() const override {
+        return !table.instances.empty();
+    }
+
+    bool bounding_box(aabb &output_box) const override {
+        output_box = box;
+        return true;
+    }
+
+    // Moving spheres only survive as entries of the table; other objects are
+    // kept whole as custom primitives or instanced bottom levels.
+    uint features() const override {
+        uint ret = table.moving_spheres.empty() ? 0u : static_cast<uint>(scene_feature::motion_blur);
+        for (const auto &custom : table.customs) {
+            ret |= custom->features();
+        }
+        for (const auto &blas_object : table.blas_objects) {
+            ret |= blas_object->features();
+        }
+        return ret;
+    }
+
+    // Expected cost of a random ray against the tree, relative to the root area.
+    [[nodiscard]]
+    float sah_cost() const;
+
+    // Brings the tree up to date after primitives of table were moved, e.g.
+    // animated spheres: leaf bounds are recomputed and propagated to the root
+    // in parallel, keeping the topology. Once that has degraded the SAH cost
+    // past refit_rebuild_threshold times the cost of the last build, the tree
+    // is rebuilt instead. Returns whether it was rebuilt.
+    bool refit(Device &device, Stream &stream);
+
+    // Builds a new SAH tree over the current primitives. The device buffers
+    // are reused, so kernels that captured them stay valid.
+    void rebuild(Device &device, Stream &stream);
+
+private:
+    uint flatten(const bvh_node &node);
+    uint flatten_child(const shared_ptr<hittable> &child);
+    uint add_leaf(const aabb &leaf_box, std::size_t first);
+    void build_sah(const luisa::vector<uint> &refs);
+    void upload(Device &device, Stream &stream);
+    void upload_nodes(Device &device, Stream &stream);
+
+    void schedule_refit(uint index, luisa::vector<uint> &top_nodes);
+    void refit_node(uint index);
+
+    // Largest number of interior nodes above a leaf, which bounds the stack
+    // traverse() uses on binary nodes.
+    [[nodiscard]]
+    uint binary_stack_depth() const;
+
+    // Turns the binary subtree at index into wide nodes, opening the largest
+    // interior child until a node has Width children. stack_depth is set to
+    // the most stack entries traverse_wide() can hold inside the subtree.
+    template<uint Width>
+    uint collapse(uint index, luisa::vector<wide_bvh_node<Width>> &wide_nodes, uint &stack_depth) const;
+
+    // Walks the nodes whose boxes overlap [t_min, t_max] and calls
+    // visit_leaf(first, count) on every leaf reached; traversal stops once it
+    // returns true. t_max is re-read at every node, so it may shrink on the way.
+    template<typename Visit>
+    void traverse(const ray &r, const Float &t_min, const Float &t_max, const Visit &visit_leaf) const;
+
+    template<uint Width, typename Visit>
+    void traverse_wide(
+        const Buffer<wide_bvh_node<Width>> &wide_buffer,
+        const ray &r,
+        const Float &t_min,
+        const Float &t_max,
+        const Visit &visit_leaf
+    ) const;
+
+public:
+    primitive_table table;
+    luisa::vector<linear_bvh_node> nodes;
+    luisa::vector<uint> primitives;// primitive references in leaf order
+    Buffer<linear_bvh_node> node_buffer;
+    Buffer<uint> primitive_buffer;
+    aabb box;
+    float built_sah_cost {};
+
+    uint width { default_bvh_width };
+    luisa::vector<bvh4_node> bvh4_nodes;
+    luisa::vector<bvh8_node> bvh8_nodes;
+    Buffer<bvh4_node> bvh4_buffer;
+    Buffer<bvh8_node> bvh8_buffer;
+};
+
+linear_bvh::linear_bvh(
+    Device &device,
+    Stream &stream,
+    const hittable_list &list,
+    bvh_build_method method
+) {
+    if (method == bvh_build_method::median) {
+        bvh_node root(list);
+        box = root.box;
+        flatten(root);
+    } else {
+        luisa::vector<uint> refs;
+        list.pack(table, refs);
+        build_sah(refs);
+    }
+
+    upload(device, stream);
+}
+
+void linear_bvh::build_sah(const luisa::vector<uint> &refs) {
+    luisa::vector<aabb> boxes;
+    boxes.reserve(refs.size());
+    for (auto ref : refs) {
+        boxes.push_back(table.bounds(ref));
+    }
+
+    luisa::vector<uint> order;
+    sah_builder().build(boxes, nodes, order);
+    primitives.reserve(order.size());
+    for (auto i : order) {
+        primitives.push_back(refs[i]);
+    }
+    box = aabb(nodes.front().box_min, nodes.front().box_max);
+}
+
+linear_bvh::linear_bvh(Device &device, Stream &stream, const bvh_node &root)
+    : box(root.box)
+{
+    flatten(root);
+    upload(device, stream);
+}
+
+void linear_bvh::upload(Device &device, Stream &stream) {
+    built_sah_cost = sah_cost();
+    LUISA_INFO(
+        "BVH: {} primitives ({} spheres, {} moving spheres, {} rects, {} instances of {} BVHs, {} custom), {} nodes, SAH cost {:.2f}.",
+        primitives.size(),
+        table.spheres.size(),
+        table.moving_spheres.size(),
+        table.rects.size(),
+        table.instances.size(),
+        table.blases.size(),
+        table.customs.size(),
+        nodes.size(),
+        built_sah_cost
+    );
+
+    table.upload(device, stream);
+    primitive_buffer = device.create_buffer<uint>(primitives.size());
+    stream << primitive_buffer.copy_from(primitives.data());
+    upload_nodes(device, stream);
+
+    if (width != 2u) {
+        auto node_count = width == 4u ? bvh4_nodes.size() : bvh8_nodes.size();
+        auto node_size = width == 4u ? sizeof(bvh4_node) : sizeof(bvh8_node);
+        LUISA_INFO(
+            "BVH{}: {} nodes of {} bytes, {:.1f} KiB ({:.1f} KiB as binary nodes).",
+            width,
+            node_count,
+            node_size,
+            static_cast<double>(node_count * node_size) / 1024.0,
+            static_cast<double>(nodes.size() * sizeof(linear_bvh_node)) / 1024.0
+        );
+    }
+}
+
+void linear_bvh::upload_nodes(Device &device, Stream &stream) {
+    // Buffers are created once with room for the largest tree over these
+    // primitives: a binary tree has at most one leaf per primitive, and a
+    // wide tree at most one node per binary interior node. Refits and
+    // rebuilds then write into the buffers that kernels have captured.
+    auto max_binary_nodes = std::max<std::size_t>(2u * primitives.size(), 2u) - 1u;
+    auto max_wide_nodes = std::max<std::size_t>(primitives.size(), 2u) - 1u;
+
+    uint stack_depth { 0u };
+    if (width == 4u) {
+        bvh4_nodes.clear();
+        collapse(0u, bvh4_nodes, stack_depth);
+    } else if (width == 8u) {
+        bvh8_nodes.clear();
+        collapse(0u, bvh8_nodes, stack_depth);
+    }
+    if (width != 2u && stack_depth > wide_bvh_stack_size) {
+        // Kernels record the traversal of one width, so it can only change
+        // before the first upload.
+        if (bvh4_buffer.size() > 0u || bvh8_buffer.size() > 0u) {
+            LUISA_ERROR("BVH{} traversal needs {} stack entries, more than {}.\n", width, stack_depth, wide_bvh_stack_size);
+        }
+        LUISA_WARNING(
+            "BVH{} traversal needs {} stack entries, more than {}, using binary nodes.",
+            width,
+            stack_depth,
+            wide_bvh_stack_size
+        );
+        width = 2u;
+    }
+    if (width == 2u && binary_stack_depth() > bvh_stack_size) {
+        LUISA_ERROR("BVH traversal needs {} stack entries, more than {}.\n", binary_stack_depth(), bvh_stack_size);
+    }
+
+    if (width == 4u) {
+        if (bvh4_buffer.size() < max_wide_nodes) {
+            bvh4_buffer = device.create_buffer<bvh4_node>(max_wide_nodes);
+        }
+        stream << bvh4_buffer.view(0u, bvh4_nodes.size()).copy_from(bvh4_nodes.data());
+    } else if (width == 8u) {
+        if (bvh8_buffer.size() < max_wide_nodes) {
+            bvh8_buffer = device.create_buffer<bvh8_node>(max_wide_nodes);
+        }
+        stream << bvh8_buffer.view(0u, bvh8_nodes.size()).copy_from(bvh8_nodes.data());
+    } else {
+        if (node_buffer.size() < max_binary_nodes) {
+            node_buffer = device.create_buffer<linear_bvh_node>(max_binary_nodes);
+        }
+        stream << node_buffer.view(0u, nodes.size()).copy_from(nodes.data());
+    }
+    stream << synchronize();
+}
+
+bool linear_bvh::refit(Device &device, Stream &stream) {
+    luisa::vector<uint> top_nodes;
+    schedule_refit(0u, top_nodes);
+    bvh_task_pool().wait();
+
+    // Parents come before their children in top_nodes.
+    for (auto i = top_nodes.rbegin(); i != top_nodes.rend(); ++i) {
+        refit_node(*i);
+    }
+    box = aabb(nodes.front().box_min, nodes.front().box_max);
+
+    auto cost = sah_cost();
+    if (cost > refit_rebuild_threshold * built_sah_cost) {
+        LUISA_INFO("BVH: SAH cost went from {:.2f} to {:.2f} through refits, rebuilding.", built_sah_cost, cost);
+        rebuild(device, stream);
+        return true;
+    }
+
+    table.update(stream);
+    upload_nodes(device, stream);
+    return false;
+}
+
+void linear_bvh::rebuild(Device &device, Stream &stream) {
+    // The primitives stay the same, only their order changes, so the
+    // primitive buffer keeps its size.
+    auto refs = std::move(primitives);
+    primitives.clear();
+    nodes.clear();
+    build_sah(refs);
+    built_sah_cost = sah_cost();
+
+    table.update(stream);
+    stream << primitive_buffer.copy_from(primitives.data());
+    upload_nodes(device, stream);
+}
+
+void linear_bvh::schedule_refit(uint index, luisa::vector<uint> &top_nodes) {
+    // A subtree is contiguous in the depth-first layout and ends after the
+    // leaf reached by always taking the second child.
+    auto end = index;
+    while (nodes[end].count == 0u) {
+        end = nodes[end].offset;
+    }
+    end++;
+
+    if (end - index <= refit_task_size) {
+        bvh_task_pool().submit([this, index, end] {
+            // Children follow their parent, so a backward sweep refits them first.
+            for (auto i = end; i-- > index;) {
+                refit_node(i);
+            }
+        });
+        return;
+    }
+
+    top_nodes.push_back(index);
+    schedule_refit(index + 1u, top_nodes);
+    schedule_refit(nodes[index].offset, top_nodes);
+}
+
+void linear_bvh::refit_node(uint index) {
+    auto &node = nodes[index];
+    aabb node_box;
+    if (node.count > 0u) {
+        node_box = table.bounds(primitives[node.offset]);
+        for (auto i = node.offset + 1u; i < node.offset + node.count; i++) {
+            node_box = surrounding_box(node_box, table.bounds(primitives[i]));
+        }
+    } else {
+        const auto &left = nodes[index + 1u];
+        const auto &right = nodes[node.offset];
+        node_box = surrounding_box(aabb(left.box_min, left.box_max), aabb(right.box_min, right.box_max));
+    }
+    node.box_min = node_box.min();
+    node.box_max = node_box.max();
+}
+
+uint linear_bvh::binary_stack_depth() const {
+    // Children follow their parent, so depths are known when a node is reached.
+    luisa::vector<uint> depths(nodes.size(), 0u);
+    uint max_depth { 0u };
+    for (std::size_t i = 0u; i < nodes.size(); i++) {
+        if (nodes[i].count == 0u) {
+            depths[i + 1u] = depths[i] + 1u;
+            depths[nodes[i].offset] = depths[i] + 1u;
+        } else {
+            max_depth = std::max(max_depth, depths[i]);
+        }
+    }
+    return max_depth;
+}
+
+template<uint Width>
+uint linear_bvh::collapse(uint index, luisa::vector<wide_bvh_node<Width>> &wide_nodes, uint &stack_depth) const {
+    const auto &node = nodes[index];
+    std::array<uint, Width> children {};
+    uint child_count { 0u };
+
+    // A tree made of a single leaf still gets a node above it.
+    if (node.count > 0u) {
+        children[child_count++] = index;
+    } else {
+        children[child_count++] = index + 1u;
+        children[child_count++] = node.offset;
+    }
+
+    while (child_count < Width) {
+        int largest = -1;
+        float largest_area { -1.0f };
+        for (uint i = 0u; i < child_count; i++) {
+            const auto &child = nodes[children[i]];
+            auto area = aabb(child.box_min, child.box_max).surface_area();
+            if (child.count == 0u && area > largest_area) {
+                largest = static_cast<int>(i);
+                largest_area = area;
+            }
+        }
+        if (largest < 0) {
+            break;
+        }
+
+        // Replace the child by its two children, keeping their order.
+        auto opened = children[largest];
+        for (auto i = child_count; i > static_cast<uint>(largest) + 1u; i--) {
+            children[i] = children[i - 1u];
+        }
+        children[largest] = opened + 1u;
+        children[largest + 1] = nodes[opened].offset;
+        child_count++;
+    }
+
+    auto wide_index = static_cast<uint>(wide_nodes.size());
+    wide_nodes.emplace_back();
+
+    // Bounds are rounded outwards, so a dequantized box always contains the
+    // child it stands for. The device may evaluate origin + bound * scale
+    // with or without a fused multiply-add, so bounds get one more step
+    // outwards than the host check needs.
+    wide_bvh_node<Width> wide {};
+    wide.origin = node.box_min;
+    wide.scale = luisa::max((node.box_max - node.box_min) * (1.0001f / 255.0f), make_float3(1e-20f));
+    auto quantize = [&](const float3 &p, bool up, std::array<uint, 3u * Width / 4u> &bounds, uint i) {
+        for (uint axis = 0u; axis < 3u; axis++) {
+            auto q = (p[axis] - wide.origin[axis]) / wide.scale[axis];
+            auto bound = static_cast<int>(up ? std::ceil(q) : std::floor(q));
+            bound = std::clamp(bound, 0, 255);
+            while (!up && bound > 0 && wide.origin[axis] + static_cast<float>(bound) * wide.scale[axis] > p[axis]) {
+                bound--;
+            }
+            while (up && bound < 255 && wide.origin[axis] + static_cast<float>(bound) * wide.scale[axis] < p[axis]) {
+                bound++;
+            }
+            bound = up ? std::min(bound + 1, 255) : std::max(bound - 1, 0);
+            bounds[axis * Width / 4u + i / 4u] |= static_cast<uint>(bound) << (8u * (i % 4u));
+        }
+    };
+
+    // Traversal pushes every child hit, then pops one of them.
+    stack_depth = child_count;
+    for (uint i = 0u; i < child_count; i++) {
+        const auto &child = nodes[children[i]];
+        quantize(child.box_min, false, wide.lo, i);
+        quantize(child.box_max, true, wide.hi, i);
+        if (child.count > 0u) {
+            if (child.count > wide_count_mask || child.offset > wide_offset_mask) {
+                LUISA_ERROR("BVH leaf does not fit in a wide node.\n");
+            }
+            wide.child[i] = wide_leaf_flag | (child.count << wide_count_shift) | child.offset;
+        } else {
+            uint child_depth { 0u };
+            wide.child[i] = collapse(children[i], wide_nodes, child_depth);
+            stack_depth = std::max(stack_depth, child_count - 1u + child_depth);
+        }
+    }
+    wide.child_count = child_count;
+    wide_nodes[wide_index] = wide;
+
+    return wide_index;
+}
+
+float linear_bvh::sah_cost() const {
+    auto root_area = box.surface_area();
+    if (root_area <= 0.0f) {
+        return 0.0f;
+    }
+
+    float cost { 0.0f };
+    for (const auto &node : nodes) {
+        auto area = aabb(node.box_min, node.box_max).surface_area() / root_area;
+        cost += node.count == 0u
+            ? sah_traversal_cost * area
+            : sah_intersection_cost * static_cast<float>(node.count) * area;
+    }
+
+    return cost;
+}
+
+uint linear_bvh::add_leaf(const aabb &leaf_box, std::size_t first) {
+    linear_bvh_node node {};
+    node.box_min = leaf_box.min();
+    node.box_max = leaf_box.max();
+    node.offset = static_cast<uint>(first);
+    node.count = static_cast<uint>(primitives.size() - first);
+
+    nodes.push_back(node);
+    return static_cast<uint>(nodes.size() - 1u);
+}
+
+uint linear_bvh::flatten_child(const shared_ptr<hittable> &child) {
+    if (auto node = dynamic_cast<const bvh_node *>(child.get())) {
+        return flatten(*node);
+    }
+
+    aabb child_box;
+    if (!child->bounding_box(child_box)) {
+        LUISA_ERROR("No bounding box in linear_bvh constructor.\n");
+    }
+
+    auto first = primitives.size();
+    pack_hittable(child, table, primitives);
+    return add_leaf(child_box, first);
+}
+
+uint linear_bvh::flatten(const bvh_node &node) {
+    auto left = dynamic_cast<const bvh_node *>(node.left.get());
+    auto right = dynamic_cast<const bvh_node *>(node.right.get());
+
+    // A node over one or two primitives becomes a single leaf.
+    if (left == nullptr && right == nullptr) {
+        auto first = primitives.size();
+        pack_hittable(node.left, table, primitives);
+        if (node.right != node.left) {
+            pack_hittable(node.right, table, primitives);
+        }
+        return add_leaf(node.box, first);
+    }
+
+    auto index = static_cast<uint>(nodes.size());
+    nodes.emplace_back();
+
+    flatten_child(node.left);
+    auto second_child = flatten_child(node.right);
+
+    linear_bvh_node interior {};
+    interior.box_min = node.box.min();
+    interior.box_max = node.box.max();
+    interior.offset = second_child;
+    interior.count = 0u;
+    interior.axis = static_cast<uint>(node.axis);
+    nodes[index] = interior;
+
+    return index;
+}
+
+template<typename Visit>
+void linear_bvh::traverse(
+    const ray &r,
+    const Float &t_min,
+    const Float &t_max,
+    const Visit &visit_leaf
+) const {
+    if (width == 4u) {
+        traverse_wide(bvh4_buffer, r, t_min, t_max, visit_leaf);
+        return;
+    }
+    if (width == 8u) {
+        traverse_wide(bvh8_buffer, r, t_min, t_max, visit_leaf);
+        return;
+    }
+
+    traversal_ray tr { r };
+    ArrayUInt<bvh_stack_size> stack;
+    UInt stack_size { 0u };
+    UInt node_index { 0u };
+
+    $loop {
+        Var<linear_bvh_node> node = node_buffer->read(node_index);
+        count_trace(&trace_counters::nodes);
+        Bool visit_children { false };
+        Bool done { false };
+
+        $if (aabb::hit(node.box_min, node.box_max, tr, t_min, t_max)) {
+            $if (node.count > 0u) {
+                done = visit_leaf(node.offset, node.count);
+            } $else {
+                visit_children = true;
+            };
+        };
+        $if (done) { $break; };
+
+        $if (visit_children) {
+            // Push the farther child and continue with the nearer one.
+            $if (tr.negative[node.axis]) {
+                stack[stack_size] = node_index + 1u;
+                node_index = node.offset;
+            } $else {
+                stack[stack_size] = node.offset;
+                node_index = node_index + 1u;
+            };
+            stack_size += 1u;
+        } $else {
+            $if (stack_size == 0u) { $break; };
+            stack_size -= 1u;
+            node_index = stack[stack_size];
+        };
+    };
+}
+
+template<uint Width, typename Visit>
+void linear_bvh::traverse_wide(
+    const Buffer<wide_bvh_node<Width>> &wide_buffer,
+    const ray &r,
+    const Float &t_min,
+    const Float &t_max,
+    const Visit &visit_leaf
+) const {
+    traversal_ray tr { r };
+    ArrayUInt<wide_bvh_stack_size> stack;
+    UInt stack_size { 0u };
+    UInt entry { 0u };
+
+    // Leaves go through the stack too, so visit_leaf is emitted only once.
+    $loop {
+        count_trace(&trace_counters::nodes);
+        Bool done { false };
+
+        $if ((entry & wide_leaf_flag) != 0u) {
+            done = visit_leaf(entry & wide_offset_mask, (entry >> wide_count_shift) & wide_count_mask);
+        } $else {
+            Var<wide_bvh_node<Width>> node = wide_buffer->read(entry);
+
+            // Every child is tested against the ray; the nearest one hit is
+            // pushed last, so that it is visited first.
+            UInt nearest { ~0u };
+            Float nearest_t { std::numeric_limits<float>::max() };
+            for (uint i = 0u; i < Width; i++) {
+                $if (i < node.child_count) {
+                    auto bounds = [&](const auto &words) {
+                        auto bound = [&](uint axis) {
+                            return cast<Float>((words[axis * Width / 4u + i / 4u] >> (8u * (i % 4u))) & 255u);
+                        };
+                        return node.origin + node.scale * make_float3(bound(0u), bound(1u), bound(2u));
+                    };
+                    Float3 box_min = bounds(node.lo);
+                    Float3 box_max = bounds(node.hi);
+                    Float t_enter;
+                    $if (aabb::slab(box_min, box_max, tr, t_min, t_max, t_enter)) {
+                        UInt child = node.child[i];
+                        $if (t_enter < nearest_t) {
+                            $if (nearest != ~0u) {
+                                stack[stack_size] = nearest;
+                                stack_size += 1u;
+                            };
+                            nearest = child;
+                            nearest_t = t_enter;
+                        } $else {
+                            stack[stack_size] = child;
+                            stack_size += 1u;
+                        };
+                    };
+                };
+            }
+            $if (nearest != ~0u) {
+                stack[stack_size] = nearest;
+                stack_size += 1u;
+            };
+        };
+
+        $if (done | (stack_size == 0u)) { $break; };
+        stack_size -= 1u;
+        entry = stack[stack_size];
+    };
+}
+
+Bool linear_bvh::hit(
+    const ray &r,
+    Float t_min,
+    Float t_max,
+    hit_record &rec,
+    UInt &seed
+) const {
+    primitive_hit closest { t_max };
+    intersect(r, t_min, closest, seed);
+    return table.resolve(closest, r, rec);
+}
+
+void linear_bvh::intersect(
+    const ray &r,
+    const Float &t_min,
+    primitive_hit &closest,
+    UInt &seed
+) const {
+    traverse(r, t_min, closest.t, [&](const UInt &first, const UInt &count) -> Bool {
+        $for (i, first, first + count) {
+            table.intersect(primitive_buffer->read(i), r, t_min, closest, seed);
+        };
+        return def(false);
+    });
+}
+
+Bool linear_bvh::occluded(
+    const ray &r,
+    Float t_min,
+    Float t_max,
+    UInt &seed
+) const {
+    Bool ret { false };
+
+    traverse(r, t_min, t_max, [&](const UInt &first, const UInt &count) -> Bool {
+        $for (i, first, first + count) {
+            $if (table.occluded(primitive_buffer->read(i), r, t_min, t_max, seed)) {
+                ret = true;
+                $break;
+            };
+        };
+        return ret;
+    });
+
+    return ret;
+}
@@ -2,6 +2,8 @@
 
 #include "rtweekend.h"
 #include "ray.h"
+#include "sampler.h"
+#include "scene_features.h"
 
 class camera {
 public:
@@ -35,9 +37,18 @@ public:
         time1 = _time1;
     }
 
+    // Lens and shutter samples are only drawn with the depth_of_field and
+    // motion_blur kernel features.
     ray get_ray(Float2 uv, UInt &seed) const {
-        Float3 rd = lens_radius * random_in_unit_disk(seed);
-        Float3 offset = u * rd.x + v * rd.y;
+        Float3 offset = make_float3(0.0f);
+        if (has_feature(scene_feature::depth_of_field)) {
+            Float3 rd = lens_radius * random_in_unit_disk(seed);
+            offset = u * rd.x + v * rd.y;
+        }
+        Float time = time0;
+        if (has_feature(scene_feature::motion_blur)) {
+            time = frand(seed, time0, time1);
+        }
 
         return {
             origin + offset,
@@ -45,10 +56,37 @@ public:
                 + uv.x * horizontal
                 + uv.y * vertical
                 - origin - offset,
-            frand(seed, time0, time1)
+            time
         };
     }
 
+    // The same ray with the lens and shutter dimensions taken from s.
+    ray get_ray(Float2 uv, sampler &s) const {
+        Float3 offset = make_float3(0.0f);
+        if (has_feature(scene_feature::depth_of_field)) {
+            Float3 rd = lens_radius * sample_unit_disk(s.next_2d());
+            offset = u * rd.x + v * rd.y;
+        }
+        Float time = time0;
+        if (has_feature(scene_feature::motion_blur)) {
+            time = lerp(def(time0), def(time1), s.next_1d());
+        }
+
+        return {
+            origin + offset,
+            lower_left_corner
+                + uv.x * horizontal
+                + uv.y * vertical
+                - origin - offset,
+            time
+        };
+    }
+
+    [[nodiscard]]
+    bool has_depth_of_field() const {
+        return lens_radius > 0.0f;
+    }
+
 private:
     float3 origin {};
     float3 lower_left_corner {};
@@ -35,6 +35,10 @@ public:
         return boundary->bounding_box(output_box);
     }
 
+    uint features() const override {
+        return static_cast<uint>(scene_feature::volumes) | boundary->features();
+    }
+
 public:
     shared_ptr<hittable> boundary;
     uint mat_id;
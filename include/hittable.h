@@ -4,9 +4,11 @@
 
 #include "ray.h"
 #include "aabb.h"
+#include "scene_features.h"
 
 
 // class material;
+class primitive_table;
 
 class hit_record {
 public:
@@ -36,6 +38,32 @@ public:
         UInt &seed
     ) const = 0;
     virtual bool bounding_box(aabb &output_box) const = 0;
+
+    // Visibility query: whether anything is hit in [t_min, t_max]. Returns on
+    // the first hit found and never computes hit attributes.
+    virtual Bool occluded(
+        const ray &r,
+        Float t_min,
+        Float t_max,
+        UInt &seed
+    ) const {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec, seed);
+    }
+
+    // Adds this object to table as typed primitives and appends their references
+    // to refs. Objects returning false are kept as custom primitives.
+    virtual bool pack(primitive_table &table, luisa::vector<uint> &refs) const {
+        return false;
+    }
+
+    // The scene_feature bits this object and everything it holds need, of
+    // those that depend on geometry: motion_blur and volumes. Objects wrapping
+    // others forward to them.
+    [[nodiscard]]
+    virtual uint features() const {
+        return 0u;
+    }
 };
 
 
@@ -61,7 +89,20 @@ public:
         UInt &seed
     ) const override;
 
+    Bool occluded(
+        const ray &r,
+        Float t_min,
+        Float t_max,
+        UInt &seed
+    ) const override {
+        return ptr->occluded(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max, seed);
+    }
+
     bool bounding_box(aabb &output_box) const override;
+
+    uint features() const override {
+        return ptr->features();
+    }
 };
 
 Bool translate::hit(
@@ -122,10 +163,27 @@ public:
         UInt &seed
     ) const override;
 
+    Bool occluded(
+        const ray &r,
+        Float t_min,
+        Float t_max,
+        UInt &seed
+    ) const override {
+        return ptr->occluded(to_object(r), t_min, t_max, seed);
+    }
+
     bool bounding_box(aabb &output_box) const override {
         output_box = bbox;
         return hasbox;
     }
+
+    uint features() const override {
+        return ptr->features();
+    }
+
+private:
+    [[nodiscard]]
+    ray to_object(const ray &r) const;
 };
 
 rotate_y::rotate_y(
@@ -165,14 +223,7 @@ rotate_y::rotate_y(
     bbox = aabb(min, max);
 }
 
-Bool rotate_y::hit(
-    const ray &r,
-    Float t_min,
-    Float t_max,
-    hit_record &rec,
-    UInt &seed
-) const {
-    Bool ret { true };
+ray rotate_y::to_object(const ray &r) const {
     Float3 origin = make_float3(
         cos_theta * r.origin()[0] - sin_theta * r.origin()[2],
         r.origin()[1],
@@ -183,7 +234,19 @@ Bool rotate_y::hit(
         r.direction()[1],
         sin_theta * r.direction()[0] + cos_theta * r.direction()[2]
     );
-    ray rotated_r(origin, direction, r.time());
+
+    return { origin, direction, r.time() };
+}
+
+Bool rotate_y::hit(
+    const ray &r,
+    Float t_min,
+    Float t_max,
+    hit_record &rec,
+    UInt &seed
+) const {
+    Bool ret { true };
+    ray rotated_r = to_object(r);
 
     $if (!ptr->hit(rotated_r, t_min, t_max, rec, seed)) {
         ret = false;
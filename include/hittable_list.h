@@ -2,12 +2,17 @@
 
 #include "hittable.h"
 #include "aabb.h"
+#include "primitive.h"
 
 
 class hittable_list : public hittable {
 public:
     luisa::vector<luisa::shared_ptr<hittable>> objects;
 
+    // Typed primitive buffers, set by build(). Without them every object emits
+    // its own hit() into the shader.
+    luisa::shared_ptr<primitive_table> table;
+
 public:
     hittable_list() = default;
 
@@ -31,8 +36,29 @@ public:
         UInt &seed
     ) const override;
 
+    Bool occluded(
+        const ray &r,
+        Float t_min,
+        Float t_max,
+        UInt &seed
+    ) const override;
+
     bool bounding_box(aabb &output_box) const override;
 
+    bool pack(primitive_table &table, luisa::vector<uint> &refs) const override;
+
+    uint features() const override {
+        uint ret { 0u };
+        for (const auto &object : objects) {
+            ret |= object->features();
+        }
+        return ret;
+    }
+
+    // Packs the objects into typed device buffers, so that hit() runs a single
+    // loop per primitive type.
+    void build(Device &device, Stream &stream);
+
     void shuffle() {
         auto temp = objects[0];
         objects[0] = objects[3];
@@ -47,6 +73,12 @@ Bool hittable_list::hit(
     hit_record &rec,
     UInt &seed
 ) const {
+    if (table != nullptr) {
+        primitive_hit closest { t_max };
+        table->intersect_all(r, t_min, closest, seed);
+        return table->resolve(closest, r, rec);
+    }
+
     hit_record temp_rec;
     Bool hit_anything { false };
     Float closest_so_far { t_max };
@@ -63,6 +95,26 @@ Bool hittable_list::hit(
     return hit_anything;
 }
 
+Bool hittable_list::occluded(
+    const ray &r,
+    Float t_min,
+    Float t_max,
+    UInt &seed
+) const {
+    if (table != nullptr) {
+        return table->occluded_all(r, t_min, t_max, seed);
+    }
+
+    Bool ret { false };
+    for (const auto &object : objects) {
+        $if (!ret) {
+            ret = object->occluded(r, t_min, t_max, seed);
+        };
+    }
+
+    return ret;
+}
+
 bool hittable_list::bounding_box(aabb &output_box) const {
     if (objects.empty()) {
         return false;
@@ -83,3 +135,19 @@ bool hittable_list::bounding_box(aabb &output_box) const {
 
     return true;
 }
+
+bool hittable_list::pack(primitive_table &table, luisa::vector<uint> &refs) const {
+    for (const auto &object : objects) {
+        pack_hittable(object, table, refs);
+    }
+
+    return true;
+}
+
+void hittable_list::build(Device &device, Stream &stream) {
+    auto packed = luisa::make_shared<primitive_table>();
+    luisa::vector<uint> refs;
+    pack(*packed, refs);
+    packed->upload(device, stream);
+    table = std::move(packed);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "primitive.h"
+
+
+// An object placed by an affine transform. Packed into a primitive_table, an
+// instance of a bottom_level (a linear_bvh) becomes one primitive holding the
+// matrix, its inverse and the shared bottom level, so any number of instances
+// cost one copy of the object and one piece of traversal code. Other objects
+// are intersected through their own hit() on the transformed ray.
+class instance : public hittable {
+public:
+    instance(shared_ptr<hittable> p, const float4x4 &transform);
+
+    Bool hit(
+        const ray &r,
+        Float t_min,
+        Float t_max,
+        hit_record &rec,
+        UInt &seed
+    ) const override;
+
+    Bool occluded(
+        const ray &r,
+        Float t_min,
+        Float t_max,
+        UInt &seed
+    ) const override {
+        return ptr->occluded(to_object(r), t_min, t_max, seed);
+    }
+
+    bool bounding_box(aabb &output_box) const override {
+        output_box = bbox;
+        return hasbox;
+    }
+
+    bool pack(primitive_table &table, luisa::vector<uint> &refs) const override;
+
+    uint features() const override {
+        return ptr->features();
+    }
+
+private:
+    [[nodiscard]]
+    ray to_object(const ray &r) const;
+
+public:
+    shared_ptr<hittable> ptr;
+    float4x4 object_to_world;
+    float4x4 world_to_object;
+    bool hasbox {};
+    aabb bbox;
+};
+
+instance::instance(shared_ptr<hittable> p, const float4x4 &transform)
+    : ptr(std::move(p))
+    , object_to_world(transform)
+    , world_to_object(inverse(transform))
+{
+    hasbox = ptr->bounding_box(bbox);
+    if (hasbox) {
+        bbox = transform_box(object_to_world, bbox);
+    }
+}
+
+ray instance::to_object(const ray &r) const {
+    Float4x4 m = world_to_object;
+    return {
+        (m * make_float4(r.origin(), 1.0f)).xyz(),
+        (m * make_float4(r.direction(), 0.0f)).xyz(),
+        r.time()
+    };
+}
+
+Bool instance::hit(
+    const ray &r,
+    Float t_min,
+    Float t_max,
+    hit_record &rec,
+    UInt &seed
+) const {
+    Bool ret = ptr->hit(to_object(r), t_min, t_max, rec, seed);
+
+    $if (ret) {
+        transform_hit(
+            def(make_affine_transform(object_to_world)),
+            def(make_affine_transform(world_to_object)),
+            rec
+        );
+    };
+
+    return ret;
+}
+
+bool instance::pack(primitive_table &table, luisa::vector<uint> &refs) const {
+    // Nested instances fold into one transform.
+    auto object = ptr;
+    auto transform = object_to_world;
+    while (auto inner = dynamic_cast<const instance *>(object.get())) {
+        transform = transform * inner->object_to_world;
+        object = inner->ptr;
+    }
+
+    auto blas = dynamic_cast<const bottom_level *>(object.get());
+    if (blas == nullptr || blas->has_instances() || !hasbox) {
+        return false;
+    }
+
+    refs.push_back(table.add(transform, object, blas));
+    return true;
+}
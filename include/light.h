@@ -0,0 +1,280 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "aarect.h"
+#include "sphere.h"
+
+#include <luisa/core/stl/unordered_map.h>
+
+
+enum struct light_type : uint {
+    rect,
+    sphere
+};
+
+static constexpr uint no_light { ~0u };
+
+// An emitter that next-event estimation samples points on. A rect spans
+// position + s * edge0 + t * edge1 for s, t in [0, 1], which are also its
+// texture coordinates. A sphere is centered at position with radius edge0.x.
+struct light_data {
+    float3 position;
+    float3 edge0;
+    float3 edge1;
+    float area;
+    uint type;
+    uint mat_id;
+};
+
+LUISA_STRUCT(light_data, position, edge0, edge1, area, type, mat_id) {};
+
+// The rects and spheres with a diffuse_light material in a scene, for direct
+// light sampling. Lights are found by material, so collect() gives every
+// light a copy of its material under an id no other object uses; a hit on
+// that id then tells which light it is. Transformed, instanced or nested
+// emitters keep the original id, are not sampled and are only found by
+// scattered rays at full weight, which is still unbiased.
+//
+// Rects are sampled by area. Spheres are sampled over the cone of directions
+// they cover from the shading point, so no sample lands on the far side.
+//
+// A path combines both ways of reaching a light with the power heuristic: at
+// diffuse and isotropic vertices sample_direct() samples a light and traces a
+// shadow ray, and a scattered ray that hits a collected light has its
+// emission weighted by emission_weight(). The last vertex a path may reach
+// traces no scattered ray, so it samples no light either.
+class light_list {
+public:
+    // Registers the emitters in world and its nested hittable_lists. Must run
+    // before world is built and before the material_table is created.
+    void collect(hittable_list &world);
+
+    void upload(Device &device, Stream &stream);
+
+    [[nodiscard]]
+    bool empty() const {
+        return lights.empty();
+    }
+
+    [[nodiscard]]
+    std::size_t size() const {
+        return lights.size();
+    }
+
+    // Light sampling contribution at a diffuse vertex rec, MIS weighted and
+    // not yet multiplied by the path throughput. u picks the light with x and
+    // the point on it with yz.
+    [[nodiscard]]
+    Float3 sample_direct(
+        const hittable &world,
+        const material_table &mats,
+        const ray &r_in,
+        const hit_record &rec,
+        const Float3 &u,
+        UInt &seed
+    ) const;
+
+    // MIS weight of the emission at rec, reached by r from a vertex that
+    // sampled its direction with solid angle density bsdf_pdf. Emission seen
+    // from the camera, after specular bounces or on uncollected emitters
+    // keeps a weight of one.
+    [[nodiscard]]
+    Float emission_weight(const ray &r, const hit_record &rec, const Float &bsdf_pdf) const;
+
+private:
+    void add(light_data light, uint &mat_id);
+
+    // Solid angle density of sampling point p with normal n on light from
+    // origin: by area for rects and spheres around origin, over the cone the
+    // sphere covers otherwise.
+    [[nodiscard]]
+    Float pdf(const Var<light_data> &light, const Float3 &origin, const Float3 &p, const Float3 &n) const;
+
+    [[nodiscard]]
+    static Float power_heuristic(const Float &f, const Float &g) {
+        return ite(f > 0.0f, f * f / (f * f + g * g), 0.0f);
+    }
+
+private:
+    luisa::vector<light_data> lights;
+    luisa::unordered_map<uint, uint> material_lights;
+    Buffer<light_data> light_buffer;
+    Buffer<uint> material_light_buffer;// light of each material id, or no_light
+};
+
+void light_list::collect(hittable_list &world) {
+    auto is_light = [](uint mat_id) {
+        return dynamic_cast<const diffuse_light *>(materials[mat_id].get()) != nullptr;
+    };
+
+    for (auto &object : world.objects) {
+        if (auto list = dynamic_cast<hittable_list *>(object.get())) {
+            collect(*list);
+        } else if (auto rect = dynamic_cast<xy_rect *>(object.get()); rect != nullptr && is_light(rect->mat_id)) {
+            add(
+                light_data {
+                    float3(rect->x0, rect->y0, rect->k),
+                    float3(rect->x1 - rect->x0, 0.0f, 0.0f),
+                    float3(0.0f, rect->y1 - rect->y0, 0.0f)
+                },
+                rect->mat_id
+            );
+        } else if (auto rect = dynamic_cast<xz_rect *>(object.get()); rect != nullptr && is_light(rect->mat_id)) {
+            add(
+                light_data {
+                    float3(rect->x0, rect->k, rect->z0),
+                    float3(rect->x1 - rect->x0, 0.0f, 0.0f),
+                    float3(0.0f, 0.0f, rect->z1 - rect->z0)
+                },
+                rect->mat_id
+            );
+        } else if (auto rect = dynamic_cast<yz_rect *>(object.get()); rect != nullptr && is_light(rect->mat_id)) {
+            add(
+                light_data {
+                    float3(rect->k, rect->y0, rect->z0),
+                    float3(0.0f, rect->y1 - rect->y0, 0.0f),
+                    float3(0.0f, 0.0f, rect->z1 - rect->z0)
+                },
+                rect->mat_id
+            );
+        } else if (auto s = dynamic_cast<sphere *>(object.get()); s != nullptr && is_light(s->mat_id)) {
+            light_data light { s->center, float3(s->radius, 0.0f, 0.0f) };
+            light.type = static_cast<uint>(light_type::sphere);
+            light.area = 4.0f * pi * s->radius * s->radius;
+            add(light, s->mat_id);
+        }
+    }
+}
+
+void light_list::add(light_data light, uint &mat_id) {
+    if (light.type == static_cast<uint>(light_type::rect)) {
+        light.area = length(cross(light.edge0, light.edge1));
+    }
+
+    // A new id even on the first use of the material, which other emitters
+    // outside of collect()'s reach may share.
+    auto mat = materials[mat_id];
+    mat_id = static_cast<uint>(materials.size());
+    materials.push_back(mat);
+    light.mat_id = mat_id;
+    material_lights[mat_id] = static_cast<uint>(lights.size());
+    lights.push_back(light);
+}
+
+void light_list::upload(Device &device, Stream &stream) {
+    if (lights.empty()) {
+        return;
+    }
+
+    luisa::vector<uint> material_light(materials.size(), no_light);
+    for (auto [mat_id, light] : material_lights) {
+        material_light[mat_id] = light;
+    }
+
+    light_buffer = device.create_buffer<light_data>(lights.size());
+    material_light_buffer = device.create_buffer<uint>(material_light.size());
+    stream << light_buffer.copy_from(lights.data())
+        << material_light_buffer.copy_from(material_light.data())
+        << synchronize();
+    LUISA_INFO("Lights: {} sampled directly.", lights.size());
+}
+
+Float light_list::pdf(
+    const Var<light_data> &light,
+    const Float3 &origin,
+    const Float3 &p,
+    const Float3 &n
+) const {
+    Float3 d = p - origin;
+    Float cos_light = abs(dot(n, normalize(d)));
+    Float area_pdf = ite(cos_light > 1e-6f, length_squared(d) / (cos_light * light.area), 0.0f);
+
+    // 1 - cos of the cone half angle, from its sine to keep far spheres precise.
+    Float sin2_max = light.edge0.x * light.edge0.x / length_squared(light.position - origin);
+    Float cone_pdf = 1.0f / (2.0f * pi * sin2_max / (1.0f + sqrt(max(1.0f - sin2_max, 0.0f))));
+    Bool in_cone = (light.type == static_cast<uint>(light_type::sphere)) & (sin2_max < 1.0f);
+    return ite(in_cone, cone_pdf, area_pdf) / static_cast<float>(lights.size());
+}
+
+Float3 light_list::sample_direct(
+    const hittable &world,
+    const material_table &mats,
+    const ray &r_in,
+    const hit_record &rec,
+    const Float3 &u,
+    UInt &seed
+) const {
+    UInt index = min(cast<UInt>(u.x * static_cast<float>(lights.size())), static_cast<uint>(lights.size() - 1u));
+    Var<light_data> light = light_buffer->read(index);
+
+    Float3 p;
+    Float3 n;
+    Float light_u;
+    Float light_v;
+    $if (light.type == static_cast<uint>(light_type::rect)) {
+        light_u = u.y;
+        light_v = u.z;
+        p = light.position + light_u * light.edge0 + light_v * light.edge1;
+        n = normalize(cross(light.edge0, light.edge1));
+    } $else {
+        Float radius = light.edge0.x;
+        Float3 to_center = light.position - rec.p;
+        Float dist2 = length_squared(to_center);
+        Float sin2_max = radius * radius / dist2;
+        $if (sin2_max < 1.0f) {
+            // A direction in the cone, then the near intersection along it.
+            Float cos_theta = 1.0f - u.y * sin2_max / (1.0f + sqrt(1.0f - sin2_max));
+            Float sin2_theta = max(1.0f - cos_theta * cos_theta, 0.0f);
+            Float phi = 2.0f * pi * u.z;
+            Float3 w = to_center / sqrt(dist2);
+            Float3 t;
+            Float3 s;
+            orthonormal_basis(w, t, s);
+            Float3 wi = sqrt(sin2_theta) * (cos(phi) * t + sin(phi) * s) + cos_theta * w;
+            Float dist = sqrt(dist2) * cos_theta - sqrt(max(radius * radius - dist2 * sin2_theta, 0.0f));
+            p = rec.p + dist * wi;
+            n = normalize(p - light.position);
+        } $else {
+            n = sample_unit_sphere(u.yz());
+            p = light.position + radius * n;
+        };
+        get_sphere_uv(n, light_u, light_v);
+    };
+
+    Float3 ret = make_float3(0.0f);
+    Float light_pdf = pdf(light, rec.p, p, n);
+    $if (light_pdf > 0.0f) {
+        Float dist = length(p - rec.p);
+        Float3 wi = (p - rec.p) / dist;
+        Float bsdf_pdf;
+        Float3 f = mats.eval(rec.mat_id, rec, wi, bsdf_pdf);
+        $if (any(f > 0.0f)) {
+            $if (!world.occluded(ray(rec.p, wi, r_in.time()), 0.001f, dist * 0.999f, seed)) {
+                ret = f * mats.emitted(light.mat_id, light_u, light_v, p)
+                    * (power_heuristic(light_pdf, bsdf_pdf) / light_pdf);
+            };
+        };
+    };
+
+    return ret;
+}
+
+Float light_list::emission_weight(const ray &r, const hit_record &rec, const Float &bsdf_pdf) const {
+    Float weight = 1.0f;
+    $if (bsdf_pdf > 0.0f) {
+        UInt index = material_light_buffer->read(rec.mat_id);
+        $if (index != no_light) {
+            Var<light_data> light = light_buffer->read(index);
+            Float3 n = ite(
+                light.type == static_cast<uint>(light_type::rect),
+                normalize(cross(light.edge0, light.edge1)),
+                normalize(rec.p - light.position)
+            );
+            weight = power_heuristic(bsdf_pdf, pdf(light, r.origin(), rec.p, n));
+        };
+    };
+    return weight;
+}
@@ -3,7 +3,34 @@
 #include "rtweekend.h"
 #include "texture.h"
 
+#include <algorithm>
+#include <array>
+
 class hit_record;
+class material_table;
+
+enum struct material_type : uint {
+    lambertian,
+    metal,
+    dielectric,
+    diffuse_light,
+    isotropic
+};
+
+static constexpr uint material_type_count { 5u };
+static constexpr uint no_texture { ~0u };
+
+// A material as the shaders see it. Solid colors live in albedo, any other
+// texture is referenced by its index in the material_table.
+struct material_record {
+    float3 albedo;// albedo, or emission of a diffuse_light
+    uint type;
+    uint texture;
+    float fuzz;
+    float ir;
+};
+
+LUISA_STRUCT(material_record, albedo, type, texture, fuzz, ir) {};
 
 class material {
 public:
@@ -12,6 +39,9 @@ public:
     }
     virtual Bool scatter(
         const ray &r_in, const hit_record &rec, Float3 &attenuation, ray &scattered, UInt &seed) const = 0;
+
+    // The record evaluated by material_table, with textures added to table.
+    virtual material_record pack(material_table &table) const = 0;
 };
 
 class lambertian : public material {
@@ -21,15 +51,16 @@ public:
 
     virtual Bool scatter(
         const ray &r_in, const hit_record &rec, Float3 &attenuation, ray &scattered, UInt &seed) const override {
-        Float3 scatter_direction = rec.normal + random_unit_vector(seed);
+        return scatter_with(albedo->value(rec.u, rec.v, rec.p), r_in, rec, attenuation, scattered, random_float3(seed));
+    }
 
-        // Catch degenerate scatter direction
-        $if (near_zero(scatter_direction)) {
-            scatter_direction = rec.normal;
-        };
+    material_record pack(material_table &table) const override;
 
-        scattered = ray(rec.p, scatter_direction, r_in.time());
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+    // The scatter_with functions draw the scattered direction from u in [0, 1)^3.
+    static Bool scatter_with(
+        const Float3 &albedo, const ray &r_in, const hit_record &rec, Float3 &attenuation, ray &scattered, const Float3 &u) {
+        scattered = ray(rec.p, sample_cosine_direction(rec.normal, u.xy()), r_in.time());
+        attenuation = albedo;
         return true;
     }
 
@@ -43,8 +74,24 @@ public:
 
     virtual Bool scatter(
         const ray &r_in, const hit_record &rec, Float3 &attenuation, ray &scattered, UInt &seed) const override {
+        return scatter_with(def(albedo), def(fuzz), r_in, rec, attenuation, scattered, random_float3(seed));
+    }
+
+    material_record pack(material_table &table) const override {
+        return { albedo, static_cast<uint>(material_type::metal), no_texture, fuzz, 1.0f };
+    }
+
+    static Bool scatter_with(
+        const Float3 &albedo,
+        const Float &fuzz,
+        const ray &r_in,
+        const hit_record &rec,
+        Float3 &attenuation,
+        ray &scattered,
+        const Float3 &u
+    ) {
         Float3 reflected = ray_reflect(normalize(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(seed), r_in.time());
+        scattered = ray(rec.p, reflected + fuzz * sample_in_unit_sphere(u), r_in.time());
         attenuation = albedo;
 
         return (dot(scattered.direction(), rec.normal) > 0.0f);
@@ -61,6 +108,15 @@ public:
 
     virtual Bool scatter(
         const ray &r_in, const hit_record &rec, Float3 &attenuation, ray &scattered, UInt &seed) const override {
+        return scatter_with(def(ir), r_in, rec, attenuation, scattered, random_float3(seed));
+    }
+
+    material_record pack(material_table &table) const override {
+        return { make_float3(1.0f), static_cast<uint>(material_type::dielectric), no_texture, 0.0f, ir };
+    }
+
+    static Bool scatter_with(
+        const Float &ir, const ray &r_in, const hit_record &rec, Float3 &attenuation, ray &scattered, const Float3 &u) {
         attenuation = make_float3(1.0f, 1.0f, 1.0f);
         Float refraction_ratio = select(ir, 1.0f / ir, rec.front_face);
 
@@ -71,7 +127,7 @@ public:
         Bool cannot_refract = refraction_ratio * sin_theta > 1.0f;
         Float3 direction;
 
-        $if (cannot_refract | reflectance(cos_theta, refraction_ratio) > frand(seed)) {
+        $if (cannot_refract | reflectance(cos_theta, refraction_ratio) > u.x) {
             direction = ray_reflect(unit_direction, rec.normal);
         }
         $else {
@@ -108,6 +164,8 @@ public:
         return emit->value(u, v, p);
     }
 
+    material_record pack(material_table &table) const override;
+
 public:
     shared_ptr<texture> emit;
 };
@@ -119,11 +177,246 @@ public:
 
     virtual Bool scatter(
         const ray &r_in, const hit_record &rec, Float3 &attenuation, ray &scattered, UInt &seed) const override {
-        scattered = ray(rec.p, random_in_unit_sphere(seed), r_in.time());
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        return scatter_with(albedo->value(rec.u, rec.v, rec.p), r_in, rec, attenuation, scattered, random_float3(seed));
+    }
+
+    material_record pack(material_table &table) const override;
+
+    static Bool scatter_with(
+        const Float3 &albedo, const ray &r_in, const hit_record &rec, Float3 &attenuation, ray &scattered, const Float3 &u) {
+        scattered = ray(rec.p, sample_in_unit_sphere(u), r_in.time());
+        attenuation = albedo;
         return true;
     }
 
 public:
     shared_ptr<texture> albedo;
-};
\ No newline at end of file
+};
+
+
+// Every registered material as one material_record in a device buffer. Shading
+// reads the record and runs one $switch over the material types, so the
+// shader holds one copy of the code per type in the scene rather than one per
+// material. Textures other than solid colors are evaluated through a second
+// $switch over the distinct textures.
+class material_table {
+public:
+    material_table(Device &device, Stream &stream);
+
+    // Returns the index of tex, or no_texture after storing a solid color
+    // in albedo.
+    uint add_texture(const shared_ptr<texture> &tex, float3 &albedo);
+
+    // Samples the material at rec from the uniform numbers u. pdf is the
+    // solid angle density of the scattered direction, or 0 for specular
+    // materials.
+    void evaluate(
+        const UInt &mat_id,
+        const ray &r_in,
+        const hit_record &rec,
+        Float3 &emitted,
+        Float3 &attenuation,
+        ray &scattered,
+        Bool &has_scatter,
+        Float &pdf,
+        const Float3 &u
+    ) const;
+
+    // Whether the material has a non-specular BSDF that eval() can evaluate
+    // for a given direction, i.e. whether direct lighting applies at rec.
+    [[nodiscard]]
+    Bool is_diffuse(const UInt &mat_id) const;
+
+    // The material_type of mat_id.
+    [[nodiscard]]
+    UInt type(const UInt &mat_id) const;
+
+    [[nodiscard]]
+    bool uses(material_type type) const {
+        return used_types[static_cast<uint>(type)];
+    }
+
+    [[nodiscard]]
+    std::size_t texture_count() const {
+        return textures.size();
+    }
+
+    // BSDF times cosine towards the unit direction wi, with the density
+    // evaluate() samples wi at.
+    [[nodiscard]]
+    Float3 eval(const UInt &mat_id, const hit_record &rec, const Float3 &wi, Float &pdf) const;
+
+    [[nodiscard]]
+    Float3 emitted(const UInt &mat_id, const Float &u, const Float &v, const Float3 &p) const;
+
+private:
+    [[nodiscard]]
+    Float3 texture_value(const Var<material_record> &m, const Float &u, const Float &v, const Float3 &p) const;
+
+private:
+    luisa::vector<material_record> records;
+    luisa::vector<shared_ptr<texture>> textures;
+    std::array<bool, material_type_count> used_types {};
+    Buffer<material_record> record_buffer;
+};
+
+material_table::material_table(Device &device, Stream &stream) {
+    for (auto &mat : materials) {
+        auto record = mat->pack(*this);
+        used_types[record.type] = true;
+        records.push_back(record);
+    }
+    if (records.empty()) {
+        LUISA_ERROR("No materials in the scene.\n");
+    }
+
+    record_buffer = device.create_buffer<material_record>(records.size());
+    stream << record_buffer.copy_from(records.data()) << synchronize();
+    LUISA_INFO(
+        "Material table: {} materials of {} types, {} textures.",
+        records.size(),
+        std::count(used_types.begin(), used_types.end(), true),
+        textures.size()
+    );
+}
+
+uint material_table::add_texture(const shared_ptr<texture> &tex, float3 &albedo) {
+    if (auto solid = dynamic_cast<const solid_color *>(tex.get())) {
+        albedo = solid->color_value;
+        return no_texture;
+    }
+
+    albedo = make_float3(1.0f);
+    auto it = std::find(textures.begin(), textures.end(), tex);
+    if (it != textures.end()) {
+        return static_cast<uint>(it - textures.begin());
+    }
+    textures.push_back(tex);
+    return static_cast<uint>(textures.size() - 1u);
+}
+
+Float3 material_table::texture_value(
+    const Var<material_record> &m,
+    const Float &u,
+    const Float &v,
+    const Float3 &p
+) const {
+    Float3 ret = m.albedo;
+    if (!textures.empty()) {
+        $if (m.texture != no_texture) {
+            $switch (m.texture) {
+                for (uint i = 0u; i < textures.size(); i++) {
+                    $case (i) {
+                        ret = textures[i]->value(u, v, p);
+                    };
+                }
+            };
+        };
+    }
+    return ret;
+}
+
+void material_table::evaluate(
+    const UInt &mat_id,
+    const ray &r_in,
+    const hit_record &rec,
+    Float3 &emitted,
+    Float3 &attenuation,
+    ray &scattered,
+    Bool &has_scatter,
+    Float &pdf,
+    const Float3 &u
+) const {
+    Var<material_record> m = record_buffer->read(mat_id);
+    emitted = make_float3(0.0f);
+    has_scatter = false;
+    pdf = 0.0f;
+
+    auto used = [this](material_type type) {
+        return used_types[static_cast<uint>(type)];
+    };
+    $switch (m.type) {
+        if (used(material_type::lambertian)) {
+            $case (static_cast<uint>(material_type::lambertian)) {
+                has_scatter = lambertian::scatter_with(
+                    texture_value(m, rec.u, rec.v, rec.p), r_in, rec, attenuation, scattered, u);
+                pdf = max(dot(rec.normal, normalize(scattered.direction())), 0.0f) / pi;
+            };
+        }
+        if (used(material_type::metal)) {
+            $case (static_cast<uint>(material_type::metal)) {
+                has_scatter = metal::scatter_with(m.albedo, m.fuzz, r_in, rec, attenuation, scattered, u);
+            };
+        }
+        if (used(material_type::dielectric)) {
+            $case (static_cast<uint>(material_type::dielectric)) {
+                has_scatter = dielectric::scatter_with(m.ir, r_in, rec, attenuation, scattered, u);
+            };
+        }
+        if (used(material_type::diffuse_light)) {
+            $case (static_cast<uint>(material_type::diffuse_light)) {
+                emitted = texture_value(m, rec.u, rec.v, rec.p);
+            };
+        }
+        if (used(material_type::isotropic)) {
+            $case (static_cast<uint>(material_type::isotropic)) {
+                has_scatter = isotropic::scatter_with(
+                    texture_value(m, rec.u, rec.v, rec.p), r_in, rec, attenuation, scattered, u);
+                pdf = 0.25f / pi;
+            };
+        }
+    };
+}
+
+UInt material_table::type(const UInt &mat_id) const {
+    return record_buffer->read(mat_id).type;
+}
+
+Bool material_table::is_diffuse(const UInt &mat_id) const {
+    UInt type = this->type(mat_id);
+    return (type == static_cast<uint>(material_type::lambertian))
+        | (type == static_cast<uint>(material_type::isotropic));
+}
+
+Float3 material_table::eval(const UInt &mat_id, const hit_record &rec, const Float3 &wi, Float &pdf) const {
+    Var<material_record> m = record_buffer->read(mat_id);
+    Float3 ret = make_float3(0.0f);
+    pdf = 0.0f;
+
+    $if (m.type == static_cast<uint>(material_type::lambertian)) {
+        pdf = max(dot(rec.normal, wi), 0.0f) / pi;
+        ret = texture_value(m, rec.u, rec.v, rec.p) * pdf;
+    } $elif (m.type == static_cast<uint>(material_type::isotropic)) {
+        pdf = 0.25f / pi;
+        ret = texture_value(m, rec.u, rec.v, rec.p) * pdf;
+    };
+
+    return ret;
+}
+
+Float3 material_table::emitted(const UInt &mat_id, const Float &u, const Float &v, const Float3 &p) const {
+    Var<material_record> m = record_buffer->read(mat_id);
+    Float3 ret = make_float3(0.0f);
+    $if (m.type == static_cast<uint>(material_type::diffuse_light)) {
+        ret = texture_value(m, u, v, p);
+    };
+    return ret;
+}
+
+material_record lambertian::pack(material_table &table) const {
+    material_record record { {}, static_cast<uint>(material_type::lambertian), no_texture, 0.0f, 1.0f };
+    record.texture = table.add_texture(albedo, record.albedo);
+    return record;
+}
+
+material_record diffuse_light::pack(material_table &table) const {
+    material_record record { {}, static_cast<uint>(material_type::diffuse_light), no_texture, 0.0f, 1.0f };
+    record.texture = table.add_texture(emit, record.albedo);
+    return record;
+}
+
+material_record isotropic::pack(material_table &table) const {
+    material_record record { {}, static_cast<uint>(material_type::isotropic), no_texture, 0.0f, 1.0f };
+    record.texture = table.add_texture(albedo, record.albedo);
+    return record;
+}
\ No newline at end of file
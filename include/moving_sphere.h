@@ -4,6 +4,7 @@
 
 #include "hittable.h"
 #include "aabb.h"
+#include "primitive.h"
 
 class moving_sphere : public hittable {
 public:
@@ -30,6 +31,21 @@ public:
     virtual bool bounding_box(
         aabb &output_box) const override;
 
+    Bool occluded(
+        const ray &r, Float t_min, Float t_max, UInt &seed) const override {
+        Float t;
+        return primitive_table::hit_sphere(center(r.time()), def(radius), r, t_min, t_max, t);
+    }
+
+    bool pack(primitive_table &table, luisa::vector<uint> &refs) const override {
+        refs.push_back(table.add(moving_sphere_data { center0, center1, time0, time1, radius, mat_id }));
+        return true;
+    }
+
+    uint features() const override {
+        return static_cast<uint>(scene_feature::motion_blur);
+    }
+
     Float3 center(Float time) const;
 
 public:
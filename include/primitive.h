@@ -0,0 +1,885 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "trace_stats.h"
+
+#include <algorithm>
+
+
+struct sphere_data {
+    float3 center;
+    float radius;
+    uint mat_id;
+};
+
+LUISA_STRUCT(sphere_data, center, radius, mat_id) {};
+
+struct moving_sphere_data {
+    float3 center0;
+    float3 center1;
+    float time0;
+    float time1;
+    float radius;
+    uint mat_id;
+};
+
+LUISA_STRUCT(moving_sphere_data, center0, center1, time0, time1, radius, mat_id) {};
+
+// An axis-aligned rectangle at coordinate k along `axis`, spanning [a0, a1] and
+// [b0, b1] on the two other axes taken in increasing order, e.g. x and y for an
+// xy_rect (axis 2).
+struct rect_data {
+    float a0;
+    float a1;
+    float b0;
+    float b1;
+    float k;
+    uint axis;
+    uint mat_id;
+};
+
+LUISA_STRUCT(rect_data, a0, a1, b0, b1, k, axis, mat_id) {};
+
+// The rows of an affine 3x4 matrix, applied to (p, 1) for points and (v, 0)
+// for vectors.
+struct affine_transform {
+    float4 row0;
+    float4 row1;
+    float4 row2;
+};
+
+LUISA_STRUCT(affine_transform, row0, row1, row2) {};
+
+struct instance_data {
+    affine_transform object_to_world;
+    affine_transform world_to_object;
+    uint blas;// index into primitive_table::blases
+};
+
+LUISA_STRUCT(instance_data, object_to_world, world_to_object, blas) {};
+
+inline affine_transform make_affine_transform(const float4x4 &m) {
+    return {
+        make_float4(m[0].x, m[1].x, m[2].x, m[3].x),
+        make_float4(m[0].y, m[1].y, m[2].y, m[3].y),
+        make_float4(m[0].z, m[1].z, m[2].z, m[3].z)
+    };
+}
+
+inline float4x4 to_float4x4(const affine_transform &m) {
+    return make_float4x4(
+        make_float4(m.row0.x, m.row1.x, m.row2.x, 0.0f),
+        make_float4(m.row0.y, m.row1.y, m.row2.y, 0.0f),
+        make_float4(m.row0.z, m.row1.z, m.row2.z, 0.0f),
+        make_float4(m.row0.w, m.row1.w, m.row2.w, 1.0f)
+    );
+}
+
+aabb transform_box(const float4x4 &m, const aabb &box) {
+    float3 min { infinity, infinity, infinity };
+    float3 max { -infinity, -infinity, -infinity };
+
+    for (int i = 0; i < 8; i++) {
+        auto corner = make_float3(
+            (i & 1) != 0 ? box.max().x : box.min().x,
+            (i & 2) != 0 ? box.max().y : box.min().y,
+            (i & 4) != 0 ? box.max().z : box.min().z
+        );
+        auto p = (m * make_float4(corner, 1.0f)).xyz();
+        min = luisa::min(min, p);
+        max = luisa::max(max, p);
+    }
+
+    return { min, max };
+}
+
+Float3 transform_point(const Var<affine_transform> &m, const Float3 &p) {
+    return make_float3(
+        dot(m.row0.xyz(), p) + m.row0.w,
+        dot(m.row1.xyz(), p) + m.row1.w,
+        dot(m.row2.xyz(), p) + m.row2.w
+    );
+}
+
+Float3 transform_vector(const Var<affine_transform> &m, const Float3 &v) {
+    return make_float3(dot(m.row0.xyz(), v), dot(m.row1.xyz(), v), dot(m.row2.xyz(), v));
+}
+
+// Normals transform by the transposed inverse, so m is the world_to_object
+// matrix of the instance.
+Float3 transform_normal(const Var<affine_transform> &m, const Float3 &n) {
+    return n.x * m.row0.xyz() + n.y * m.row1.xyz() + n.z * m.row2.xyz();
+}
+
+// Moves a hit found on the object-space ray of an instance to world space.
+// The face side is unchanged, since the transposed inverse keeps the sign of
+// dot(direction, normal).
+void transform_hit(
+    const Var<affine_transform> &object_to_world,
+    const Var<affine_transform> &world_to_object,
+    hit_record &rec
+) {
+    rec.p = transform_point(object_to_world, rec.p);
+    rec.normal = normalize(transform_normal(world_to_object, rec.normal));
+}
+
+enum struct primitive_type : uint {
+    sphere,
+    moving_sphere,
+    rect,
+    instance,// a transformed bottom_level
+    custom// any other hittable, intersected through its own hit()
+};
+
+// A primitive reference packs the type into the high bits and the index into
+// the per-type buffer into the low bits.
+static constexpr uint primitive_type_shift { 28u };
+static constexpr uint primitive_index_mask { (1u << primitive_type_shift) - 1u };
+static constexpr uint invalid_primitive { ~0u };
+
+inline uint make_primitive_ref(primitive_type type, std::size_t index) {
+    if (index > primitive_index_mask) {
+        LUISA_ERROR("Too many primitives of one type.\n");
+    }
+    return (static_cast<uint>(type) << primitive_type_shift) | static_cast<uint>(index);
+}
+
+void get_sphere_uv(const Float3 &p, Float &u, Float &v) {
+    // p: a given point on the sphere of radius one, centered at the origin.
+    // u: returned value [0,1] of angle around the Y axis from X=-1.
+    // v: returned value [0,1] of angle from Y=-1 to Y=+1.
+    //     <1 0 0> yields <0.50 0.50>       <-1  0  0> yields <0.00 0.50>
+    //     <0 1 0> yields <0.50 1.00>       < 0 -1  0> yields <0.50 0.00>
+    //     <0 0 1> yields <0.25 0.50>       < 0  0 -1> yields <0.75 0.50>
+
+    auto theta = acos(-p.y);
+    auto phi = atan2(-p.z, p.x) + pi;
+
+    u = phi / (2 * pi);
+    v = theta / pi;
+}
+
+
+// The closest primitive found so far. Only the distance and the primitive are
+// tracked during traversal; the full hit_record is resolved once at the end.
+class primitive_hit {
+public:
+    UInt prim { invalid_primitive };
+    UInt blas_prim { invalid_primitive };// primitive of the bottom level when prim is an instance
+    Float t {};
+    hit_record custom_rec;// filled when the closest primitive is a custom one
+
+public:
+    explicit primitive_hit(const Float &t_max)
+        : t(t_max)
+    {}
+};
+
+
+// A structure that instances can point at. It finds the closest primitive of
+// its own table, in object space, and resolves it once traversal is done.
+class bottom_level {
+public:
+    virtual ~bottom_level() = default;
+
+    virtual void intersect(
+        const ray &r,
+        const Float &t_min,
+        primitive_hit &closest,
+        UInt &seed
+    ) const = 0;
+
+    virtual Bool resolve(const primitive_hit &closest, const ray &r, hit_record &rec) const = 0;
+
+    virtual Bool occluded(
+        const ray &r,
+        Float t_min,
+        Float t_max,
+        UInt &seed
+    ) const = 0;
+
+    // Instances keep a single bottom-level primitive, so a bottom level that
+    // holds instances itself can only be used through hit().
+    [[nodiscard]]
+    virtual bool has_instances() const = 0;
+};
+
+
+// Primitives grouped by type into device buffers, so that each type is
+// intersected by one piece of code reading its buffer, however many
+// primitives there are.
+class primitive_table {
+public:
+    uint add(const sphere_data &s);
+    uint add(const moving_sphere_data &s);
+    uint add(const rect_data &s);
+    uint add(const shared_ptr<hittable> &object);
+    // Bottom levels are shared by all instances of the same object.
+    uint add(const float4x4 &object_to_world, const shared_ptr<hittable> &object, const bottom_level *blas);
+
+    [[nodiscard]]
+    aabb bounds(uint ref) const;
+
+    void upload(Device &device, Stream &stream);
+
+    // Copies the host data into the buffers created by upload(), after
+    // primitives were changed in place.
+    void update(Stream &stream);
+
+    // Tests one primitive against [t_min, closest.t] and records it when nearer.
+    void intersect(
+        const UInt &ref,
+        const ray &r,
+        const Float &t_min,
+        primitive_hit &closest,
+        UInt &seed
+    ) const;
+
+    // Tests every primitive of the table, with one loop per primitive type.
+    void intersect_all(
+        const ray &r,
+        const Float &t_min,
+        primitive_hit &closest,
+        UInt &seed
+    ) const;
+
+    // Fills rec for the closest primitive; returns whether anything was hit.
+    Bool resolve(const primitive_hit &closest, const ray &r, hit_record &rec) const;
+
+    // Whether one primitive is hit anywhere in [t_min, t_max].
+    Bool occluded(
+        const UInt &ref,
+        const ray &r,
+        const Float &t_min,
+        const Float &t_max,
+        UInt &seed
+    ) const;
+
+    // Whether any primitive of the table is hit, stopping at the first one.
+    Bool occluded_all(
+        const ray &r,
+        const Float &t_min,
+        const Float &t_max,
+        UInt &seed
+    ) const;
+
+    static Bool hit_sphere(
+        const Float3 &center,
+        const Float &radius,
+        const ray &r,
+        const Float &t_min,
+        const Float &t_max,
+        Float &t
+    );
+
+    static Bool hit_rect(
+        const Var<rect_data> &rect,
+        const ray &r,
+        const Float &t_min,
+        const Float &t_max,
+        Float &t
+    );
+
+    static Float3 moving_center(const Var<moving_sphere_data> &s, const Float &time) {
+        return s.center0 + ((time - s.time0) / (s.time1 - s.time0)) * (s.center1 - s.center0);
+    }
+
+    static ray to_object(const Var<instance_data> &inst, const ray &r) {
+        return {
+            transform_point(inst.world_to_object, r.origin()),
+            transform_vector(inst.world_to_object, r.direction()),
+            r.time()
+        };
+    }
+
+private:
+    void intersect_custom(
+        uint index,
+        const ray &r,
+        const Float &t_min,
+        primitive_hit &closest,
+        UInt &seed
+    ) const;
+
+    void intersect_instance(
+        const UInt &index,
+        const UInt &ref,
+        const ray &r,
+        const Float &t_min,
+        primitive_hit &closest,
+        UInt &seed
+    ) const;
+
+    Bool occluded_instance(
+        const UInt &index,
+        const ray &r,
+        const Float &t_min,
+        const Float &t_max,
+        UInt &seed
+    ) const;
+
+public:
+    luisa::vector<sphere_data> spheres;
+    luisa::vector<moving_sphere_data> moving_spheres;
+    luisa::vector<rect_data> rects;
+    luisa::vector<instance_data> instances;
+    luisa::vector<shared_ptr<hittable>> customs;
+    luisa::vector<const bottom_level *> blases;
+    luisa::vector<shared_ptr<hittable>> blas_objects;// owners of blases
+
+    Buffer<sphere_data> sphere_buffer;
+    Buffer<moving_sphere_data> moving_sphere_buffer;
+    Buffer<rect_data> rect_buffer;
+    Buffer<instance_data> instance_buffer;
+};
+
+uint primitive_table::add(const sphere_data &s) {
+    spheres.push_back(s);
+    return make_primitive_ref(primitive_type::sphere, spheres.size() - 1u);
+}
+
+uint primitive_table::add(const moving_sphere_data &s) {
+    moving_spheres.push_back(s);
+    return make_primitive_ref(primitive_type::moving_sphere, moving_spheres.size() - 1u);
+}
+
+uint primitive_table::add(const rect_data &s) {
+    rects.push_back(s);
+    return make_primitive_ref(primitive_type::rect, rects.size() - 1u);
+}
+
+uint primitive_table::add(const shared_ptr<hittable> &object) {
+    customs.push_back(object);
+    return make_primitive_ref(primitive_type::custom, customs.size() - 1u);
+}
+
+uint primitive_table::add(
+    const float4x4 &object_to_world,
+    const shared_ptr<hittable> &object,
+    const bottom_level *blas
+) {
+    auto iter = std::find(blases.begin(), blases.end(), blas);
+    if (iter == blases.end()) {
+        blases.push_back(blas);
+        blas_objects.push_back(object);
+        iter = blases.end() - 1;
+    }
+
+    instance_data inst {};
+    inst.object_to_world = make_affine_transform(object_to_world);
+    inst.world_to_object = make_affine_transform(inverse(object_to_world));
+    inst.blas = static_cast<uint>(iter - blases.begin());
+    instances.push_back(inst);
+    return make_primitive_ref(primitive_type::instance, instances.size() - 1u);
+}
+
+aabb primitive_table::bounds(uint ref) const {
+    auto index = ref & primitive_index_mask;
+
+    switch (static_cast<primitive_type>(ref >> primitive_type_shift)) {
+        case primitive_type::sphere: {
+            const auto &s = spheres[index];
+            return { s.center - s.radius, s.center + s.radius };
+        }
+        case primitive_type::moving_sphere: {
+            const auto &s = moving_spheres[index];
+            return surrounding_box(
+                aabb(s.center0 - s.radius, s.center0 + s.radius),
+                aabb(s.center1 - s.radius, s.center1 + s.radius)
+            );
+        }
+        case primitive_type::rect: {
+            // The bounding box must have non-zero width in each dimension, so pad
+            // the constant axis a small amount.
+            const auto &s = rects[index];
+            auto a = s.axis == 0u ? 1u : 0u;
+            auto b = s.axis == 2u ? 1u : 2u;
+            float3 min {};
+            float3 max {};
+            min[s.axis] = s.k - 0.0001f;
+            max[s.axis] = s.k + 0.0001f;
+            min[a] = s.a0;
+            max[a] = s.a1;
+            min[b] = s.b0;
+            max[b] = s.b1;
+            return { min, max };
+        }
+        case primitive_type::instance: {
+            const auto &inst = instances[index];
+            aabb output_box;
+            if (!blas_objects[inst.blas]->bounding_box(output_box)) {
+                LUISA_ERROR("No bounding box for instanced object.\n");
+            }
+            return transform_box(to_float4x4(inst.object_to_world), output_box);
+        }
+        default: {
+            aabb output_box;
+            if (!customs[index]->bounding_box(output_box)) {
+                LUISA_ERROR("No bounding box for primitive.\n");
+            }
+            return output_box;
+        }
+    }
+}
+
+void primitive_table::upload(Device &device, Stream &stream) {
+    if (!spheres.empty()) {
+        sphere_buffer = device.create_buffer<sphere_data>(spheres.size());
+        stream << sphere_buffer.copy_from(spheres.data());
+    }
+    if (!moving_spheres.empty()) {
+        moving_sphere_buffer = device.create_buffer<moving_sphere_data>(moving_spheres.size());
+        stream << moving_sphere_buffer.copy_from(moving_spheres.data());
+    }
+    if (!rects.empty()) {
+        rect_buffer = device.create_buffer<rect_data>(rects.size());
+        stream << rect_buffer.copy_from(rects.data());
+    }
+    if (!instances.empty()) {
+        instance_buffer = device.create_buffer<instance_data>(instances.size());
+        stream << instance_buffer.copy_from(instances.data());
+    }
+    stream << synchronize();
+}
+
+void primitive_table::update(Stream &stream) {
+    if (!spheres.empty()) {
+        stream << sphere_buffer.copy_from(spheres.data());
+    }
+    if (!moving_spheres.empty()) {
+        stream << moving_sphere_buffer.copy_from(moving_spheres.data());
+    }
+    if (!rects.empty()) {
+        stream << rect_buffer.copy_from(rects.data());
+    }
+    if (!instances.empty()) {
+        stream << instance_buffer.copy_from(instances.data());
+    }
+    stream << synchronize();
+}
+
+Bool primitive_table::hit_sphere(
+    const Float3 &center,
+    const Float &radius,
+    const ray &r,
+    const Float &t_min,
+    const Float &t_max,
+    Float &t
+) {
+    Bool ret { false };
+    count_trace(&trace_counters::primitive_tests);
+
+    Float3 oc = r.origin() - center;
+    Float a = length_squared(r.direction());
+    Float half_b = dot(oc, r.direction());
+    Float c = length_squared(oc) - radius * radius;
+
+    Float discriminant = half_b * half_b - a * c;
+    $if (discriminant >= 0.0f) {
+        Float sqrtd = sqrt(discriminant);
+
+        // Find the nearest root that lies in the acceptable range.
+        Float root = (-half_b - sqrtd) / a;
+        $if ((root < t_min) | (t_max < root)) {
+            root = (-half_b + sqrtd) / a;
+        };
+        $if ((root >= t_min) & (root <= t_max)) {
+            t = root;
+            ret = true;
+        };
+    };
+
+    return ret;
+}
+
+Bool primitive_table::hit_rect(
+    const Var<rect_data> &rect,
+    const ray &r,
+    const Float &t_min,
+    const Float &t_max,
+    Float &t
+) {
+    Bool ret { false };
+    count_trace(&trace_counters::primitive_tests);
+
+    UInt a = ite(rect.axis == 0u, 1u, 0u);
+    UInt b = ite(rect.axis == 2u, 1u, 2u);
+    Float root = (rect.k - r.origin()[rect.axis]) / r.direction()[rect.axis];
+    $if ((root >= t_min) & (root <= t_max)) {
+        auto x = r.origin()[a] + root * r.direction()[a];
+        auto y = r.origin()[b] + root * r.direction()[b];
+        $if ((x >= rect.a0) & (x <= rect.a1) & (y >= rect.b0) & (y <= rect.b1)) {
+            t = root;
+            ret = true;
+        };
+    };
+
+    return ret;
+}
+
+void primitive_table::intersect_custom(
+    uint index,
+    const ray &r,
+    const Float &t_min,
+    primitive_hit &closest,
+    UInt &seed
+) const {
+    hit_record rec;
+    count_trace(&trace_counters::primitive_tests);
+    $if (customs[index]->hit(r, t_min, closest.t, rec, seed)) {
+        closest.t = rec.t;
+        closest.prim = make_primitive_ref(primitive_type::custom, index);
+        closest.custom_rec = rec;
+    };
+}
+
+void primitive_table::intersect_instance(
+    const UInt &index,
+    const UInt &ref,
+    const ray &r,
+    const Float &t_min,
+    primitive_hit &closest,
+    UInt &seed
+) const {
+    // t is shared with the object-space ray, whose direction is not
+    // renormalized.
+    Var<instance_data> inst = instance_buffer->read(index);
+    ray object_r = to_object(inst, r);
+    primitive_hit inner { closest.t };
+
+    $switch (inst.blas) {
+        for (uint i = 0; i < blases.size(); i++) {
+            $case (i) {
+                blases[i]->intersect(object_r, t_min, inner, seed);
+            };
+        }
+    };
+
+    $if (inner.prim != invalid_primitive) {
+        closest.t = inner.t;
+        closest.prim = ref;
+        closest.blas_prim = inner.prim;
+        closest.custom_rec = inner.custom_rec;
+    };
+}
+
+Bool primitive_table::occluded_instance(
+    const UInt &index,
+    const ray &r,
+    const Float &t_min,
+    const Float &t_max,
+    UInt &seed
+) const {
+    Var<instance_data> inst = instance_buffer->read(index);
+    ray object_r = to_object(inst, r);
+    Bool ret { false };
+
+    $switch (inst.blas) {
+        for (uint i = 0; i < blases.size(); i++) {
+            $case (i) {
+                ret = blases[i]->occluded(object_r, t_min, t_max, seed);
+            };
+        }
+    };
+
+    return ret;
+}
+
+void primitive_table::intersect(
+    const UInt &ref,
+    const ray &r,
+    const Float &t_min,
+    primitive_hit &closest,
+    UInt &seed
+) const {
+    UInt index = ref & primitive_index_mask;
+    Float t;
+
+    $switch (ref >> primitive_type_shift) {
+        if (!spheres.empty()) {
+            $case (static_cast<uint>(primitive_type::sphere)) {
+                Var<sphere_data> s = sphere_buffer->read(index);
+                $if (hit_sphere(s.center, s.radius, r, t_min, closest.t, t)) {
+                    closest.t = t;
+                    closest.prim = ref;
+                };
+            };
+        }
+        if (!moving_spheres.empty()) {
+            $case (static_cast<uint>(primitive_type::moving_sphere)) {
+                Var<moving_sphere_data> s = moving_sphere_buffer->read(index);
+                $if (hit_sphere(moving_center(s, r.time()), s.radius, r, t_min, closest.t, t)) {
+                    closest.t = t;
+                    closest.prim = ref;
+                };
+            };
+        }
+        if (!rects.empty()) {
+            $case (static_cast<uint>(primitive_type::rect)) {
+                $if (hit_rect(rect_buffer->read(index), r, t_min, closest.t, t)) {
+                    closest.t = t;
+                    closest.prim = ref;
+                };
+            };
+        }
+        if (!instances.empty()) {
+            $case (static_cast<uint>(primitive_type::instance)) {
+                intersect_instance(index, ref, r, t_min, closest, seed);
+            };
+        }
+        if (!customs.empty()) {
+            $case (static_cast<uint>(primitive_type::custom)) {
+                $switch (index) {
+                    for (uint i = 0; i < customs.size(); i++) {
+                        $case (i) {
+                            intersect_custom(i, r, t_min, closest, seed);
+                        };
+                    }
+                };
+            };
+        }
+    };
+}
+
+void primitive_table::intersect_all(
+    const ray &r,
+    const Float &t_min,
+    primitive_hit &closest,
+    UInt &seed
+) const {
+    Float t;
+
+    if (!spheres.empty()) {
+        $for (i, 0u, static_cast<uint>(spheres.size())) {
+            Var<sphere_data> s = sphere_buffer->read(i);
+            $if (hit_sphere(s.center, s.radius, r, t_min, closest.t, t)) {
+                closest.t = t;
+                closest.prim = make_primitive_ref(primitive_type::sphere, 0u) | i;
+            };
+        };
+    }
+    if (!moving_spheres.empty()) {
+        $for (i, 0u, static_cast<uint>(moving_spheres.size())) {
+            Var<moving_sphere_data> s = moving_sphere_buffer->read(i);
+            $if (hit_sphere(moving_center(s, r.time()), s.radius, r, t_min, closest.t, t)) {
+                closest.t = t;
+                closest.prim = make_primitive_ref(primitive_type::moving_sphere, 0u) | i;
+            };
+        };
+    }
+    if (!rects.empty()) {
+        $for (i, 0u, static_cast<uint>(rects.size())) {
+            $if (hit_rect(rect_buffer->read(i), r, t_min, closest.t, t)) {
+                closest.t = t;
+                closest.prim = make_primitive_ref(primitive_type::rect, 0u) | i;
+            };
+        };
+    }
+    if (!instances.empty()) {
+        $for (i, 0u, static_cast<uint>(instances.size())) {
+            intersect_instance(i, make_primitive_ref(primitive_type::instance, 0u) | i, r, t_min, closest, seed);
+        };
+    }
+    for (uint i = 0; i < customs.size(); i++) {
+        intersect_custom(i, r, t_min, closest, seed);
+    }
+}
+
+Bool primitive_table::resolve(
+    const primitive_hit &closest,
+    const ray &r,
+    hit_record &rec
+) const {
+    Bool ret = closest.prim != invalid_primitive;
+    UInt index = closest.prim & primitive_index_mask;
+
+    $if (ret) {
+        rec.t = closest.t;
+        rec.p = r.at(closest.t);
+
+        $switch (closest.prim >> primitive_type_shift) {
+            if (!spheres.empty()) {
+                $case (static_cast<uint>(primitive_type::sphere)) {
+                    Var<sphere_data> s = sphere_buffer->read(index);
+                    Float3 outward_normal = (rec.p - s.center) / s.radius;
+                    rec.set_face_normal(r, outward_normal);
+                    get_sphere_uv(outward_normal, rec.u, rec.v);
+                    rec.mat_id = s.mat_id;
+                };
+            }
+            if (!moving_spheres.empty()) {
+                $case (static_cast<uint>(primitive_type::moving_sphere)) {
+                    Var<moving_sphere_data> s = moving_sphere_buffer->read(index);
+                    Float3 outward_normal = (rec.p - moving_center(s, r.time())) / s.radius;
+                    rec.set_face_normal(r, outward_normal);
+                    get_sphere_uv(outward_normal, rec.u, rec.v);
+                    rec.mat_id = s.mat_id;
+                };
+            }
+            if (!rects.empty()) {
+                $case (static_cast<uint>(primitive_type::rect)) {
+                    Var<rect_data> s = rect_buffer->read(index);
+                    UInt a = ite(s.axis == 0u, 1u, 0u);
+                    UInt b = ite(s.axis == 2u, 1u, 2u);
+                    rec.u = (rec.p[a] - s.a0) / (s.a1 - s.a0);
+                    rec.v = (rec.p[b] - s.b0) / (s.b1 - s.b0);
+                    Float3 outward_normal = ite(
+                        s.axis == 0u,
+                        make_float3(1.0f, 0.0f, 0.0f),
+                        ite(s.axis == 1u, make_float3(0.0f, 1.0f, 0.0f), make_float3(0.0f, 0.0f, 1.0f))
+                    );
+                    rec.set_face_normal(r, outward_normal);
+                    rec.mat_id = s.mat_id;
+                };
+            }
+            if (!instances.empty()) {
+                $case (static_cast<uint>(primitive_type::instance)) {
+                    Var<instance_data> inst = instance_buffer->read(index);
+                    primitive_hit inner { closest.t };
+                    inner.prim = closest.blas_prim;
+                    inner.custom_rec = closest.custom_rec;
+
+                    $switch (inst.blas) {
+                        for (uint i = 0; i < blases.size(); i++) {
+                            $case (i) {
+                                blases[i]->resolve(inner, to_object(inst, r), rec);
+                            };
+                        }
+                    };
+
+                    transform_hit(inst.object_to_world, inst.world_to_object, rec);
+                };
+            }
+            if (!customs.empty()) {
+                $case (static_cast<uint>(primitive_type::custom)) {
+                    rec = closest.custom_rec;
+                };
+            }
+        };
+    };
+
+    return ret;
+}
+
+
+Bool primitive_table::occluded(
+    const UInt &ref,
+    const ray &r,
+    const Float &t_min,
+    const Float &t_max,
+    UInt &seed
+) const {
+    UInt index = ref & primitive_index_mask;
+    Bool ret { false };
+    Float t;
+
+    $switch (ref >> primitive_type_shift) {
+        if (!spheres.empty()) {
+            $case (static_cast<uint>(primitive_type::sphere)) {
+                Var<sphere_data> s = sphere_buffer->read(index);
+                ret = hit_sphere(s.center, s.radius, r, t_min, t_max, t);
+            };
+        }
+        if (!moving_spheres.empty()) {
+            $case (static_cast<uint>(primitive_type::moving_sphere)) {
+                Var<moving_sphere_data> s = moving_sphere_buffer->read(index);
+                ret = hit_sphere(moving_center(s, r.time()), s.radius, r, t_min, t_max, t);
+            };
+        }
+        if (!rects.empty()) {
+            $case (static_cast<uint>(primitive_type::rect)) {
+                ret = hit_rect(rect_buffer->read(index), r, t_min, t_max, t);
+            };
+        }
+        if (!instances.empty()) {
+            $case (static_cast<uint>(primitive_type::instance)) {
+                ret = occluded_instance(index, r, t_min, t_max, seed);
+            };
+        }
+        if (!customs.empty()) {
+            $case (static_cast<uint>(primitive_type::custom)) {
+                $switch (index) {
+                    for (uint i = 0; i < customs.size(); i++) {
+                        $case (i) {
+                            ret = customs[i]->occluded(r, t_min, t_max, seed);
+                        };
+                    }
+                };
+            };
+        }
+    };
+
+    return ret;
+}
+
+Bool primitive_table::occluded_all(
+    const ray &r,
+    const Float &t_min,
+    const Float &t_max,
+    UInt &seed
+) const {
+    Bool ret { false };
+    Float t;
+
+    if (!spheres.empty()) {
+        $for (i, 0u, static_cast<uint>(spheres.size())) {
+            Var<sphere_data> s = sphere_buffer->read(i);
+            $if (hit_sphere(s.center, s.radius, r, t_min, t_max, t)) {
+                ret = true;
+                $break;
+            };
+        };
+    }
+    if (!moving_spheres.empty()) {
+        $if (!ret) {
+            $for (i, 0u, static_cast<uint>(moving_spheres.size())) {
+                Var<moving_sphere_data> s = moving_sphere_buffer->read(i);
+                $if (hit_sphere(moving_center(s, r.time()), s.radius, r, t_min, t_max, t)) {
+                    ret = true;
+                    $break;
+                };
+            };
+        };
+    }
+    if (!rects.empty()) {
+        $if (!ret) {
+            $for (i, 0u, static_cast<uint>(rects.size())) {
+                $if (hit_rect(rect_buffer->read(i), r, t_min, t_max, t)) {
+                    ret = true;
+                    $break;
+                };
+            };
+        };
+    }
+    if (!instances.empty()) {
+        $if (!ret) {
+            $for (i, 0u, static_cast<uint>(instances.size())) {
+                $if (occluded_instance(i, r, t_min, t_max, seed)) {
+                    ret = true;
+                    $break;
+                };
+            };
+        };
+    }
+    for (const auto &object : customs) {
+        $if (!ret) {
+            ret = object->occluded(r, t_min, t_max, seed);
+        };
+    }
+
+    return ret;
+}
+
+
+// Adds object to table, as typed primitives when it knows how to pack itself
+// and as a custom primitive otherwise, and appends the references to refs.
+void pack_hittable(
+    const shared_ptr<hittable> &object,
+    primitive_table &table,
+    luisa::vector<uint> &refs
+) {
+    if (!object->pack(table, refs)) {
+        refs.push_back(table.add(object));
+    }
+}
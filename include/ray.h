@@ -37,3 +37,41 @@ public:
         return orig + t * dir;
     }
 };
+
+// How the kernels being recorded run slab tests. Only --bench-traversal picks
+// anything but precomputed, to compare against the tests it replaced.
+enum struct slab_test_method {
+    precomputed,// reciprocal direction and sign bits of traversal_ray, all axes at once
+    division,   // the same, dividing by the direction in every test
+    per_axis    // the test traversal_ray replaced: a division, a swap and an early out per axis
+};
+
+slab_test_method default_slab_test_method { slab_test_method::precomputed };
+
+// A ray prepared for slab tests against many boxes, built once before
+// traversal: the reciprocal of the direction, and for each axis whether the
+// ray runs towards negative coordinates and so enters through the box maximum.
+class traversal_ray {
+public:
+    explicit traversal_ray(const ray &r)
+        : origin(r.origin())
+        , direction(r.direction())
+        , inv_direction(1.0f / r.direction())
+        , negative(r.direction() < 0.0f)
+    {}
+
+    // Distances along the ray to the planes through bounds, one per axis.
+    [[nodiscard]]
+    Float3 slab_distance(const Float3 &bounds) const {
+        if (default_slab_test_method == slab_test_method::precomputed) {
+            return (bounds - origin) * inv_direction;
+        }
+        return (bounds - origin) / direction;
+    }
+
+public:
+    Float3 origin;
+    Float3 direction;
+    Float3 inv_direction;
+    Bool3 negative;
+};
@@ -58,6 +58,25 @@ Float frand(UInt &state) noexcept {
     );
 }
 
+// The output permutation of a PCG step, a cheap hash with good avalanche.
+UInt pcg_hash(UInt v) noexcept {
+    UInt state = v * 747796405u + 2891336453u;
+    UInt word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// Random numbers are keyed on where they are used rather than carried from
+// sample to sample: a sample of a pixel has a key, and each of its bounces a
+// seed hashed from the key, which frand then steps through the dimensions of
+// the bounce. Bounce 0 is the camera ray, bounce d + 1 the d-th path vertex.
+UInt sample_key(const UInt2 &pixel, const UInt &sample_index) noexcept {
+    return pcg_hash(pcg_hash(pcg_hash(pixel.x) ^ pixel.y) ^ sample_index);
+}
+
+UInt bounce_seed(const UInt &key, const UInt &bounce) noexcept {
+    return pcg_hash(key ^ pcg_hash(bounce));
+}
+
 Float frand(UInt &state, Float min, Float max) noexcept {
     return min + (max - min) * frand(state);
 }
@@ -70,28 +89,86 @@ Float3 random_float3(UInt &seed, const Float& min, const Float& max) {
     return make_float3(frand(seed, min, max), frand(seed, min, max), frand(seed, min, max));
 }
 
-Float3 random_in_unit_sphere(UInt &seed) {
-    Float3 p;
-    $loop {
-        p = random_float3(seed, -1.0f, 1.0f);
-        $if (length_squared(p) < 1.0f) { $break; };
-    };
-    return p;
+// Concentric map of u in [0, 1)^2 onto the unit disk in the xy plane.
+Float3 sample_unit_disk(const Float2 &u) {
+    Float2 p = 2.0f * u - 1.0f;
+    Bool x_major = abs(p.x) > abs(p.y);
+    Float r = ite(x_major, p.x, p.y);
+    Float theta = ite(
+        x_major,
+        (pi / 4.0f) * (p.y / p.x),
+        (pi / 2.0f) - (pi / 4.0f) * (p.x / p.y)
+    );
+    return ite(
+        (p.x == 0.0f) & (p.y == 0.0f),
+        make_float3(0.0f),
+        make_float3(r * cos(theta), r * sin(theta), 0.0f)
+    );
+}
+
+// Uniform direction from u in [0, 1)^2.
+Float3 sample_unit_sphere(const Float2 &u) {
+    Float z = 1.0f - 2.0f * u.x;
+    Float r = sqrt(max(1.0f - z * z, 0.0f));
+    Float phi = 2.0f * pi * u.y;
+    return make_float3(r * cos(phi), r * sin(phi), z);
 }
 
+// A uniform point of the unit ball from u in [0, 1)^3: a direction scaled by
+// the cube root of a uniform radius.
+Float3 sample_in_unit_sphere(const Float3 &u) {
+    return sample_unit_sphere(u.xy()) * pow(u.z, 1.0f / 3.0f);
+}
+
+// Unit vectors t and s completing the unit vector n to an orthonormal frame,
+// the branchless construction of Duff et al., "Building an Orthonormal
+// Basis, Revisited".
+void orthonormal_basis(const Float3 &n, Float3 &t, Float3 &s) {
+    Float sign = ite(n.z >= 0.0f, 1.0f, -1.0f);
+    Float a = -1.0f / (sign + n.z);
+    Float b = n.x * n.y * a;
+    t = make_float3(1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+    s = make_float3(b, sign + n.y * n.y * a, -n.y);
+}
+
+// Cosine-weighted direction about the unit vector n from u in [0, 1)^2, by
+// lifting a point of the unit disk onto the hemisphere (Malley's method).
+Float3 sample_cosine_direction(const Float3 &n, const Float2 &u) {
+    Float3 d = sample_unit_disk(u);
+    Float z = sqrt(max(1.0f - d.x * d.x - d.y * d.y, 0.0f));
+
+    Float3 t;
+    Float3 s;
+    orthonormal_basis(n, t, s);
+    return d.x * t + d.y * s + z * n;
+}
+
+// The random_* samplers below map a fixed number of frand draws in closed
+// form, so every thread of a warp takes the same path through them.
+
 Float3 random_unit_vector(UInt &seed) {
-    return normalize(random_in_unit_sphere(seed));
+    Float u0 = frand(seed);
+    Float u1 = frand(seed);
+    return sample_unit_sphere(make_float2(u0, u1));
+}
+
+Float3 random_in_unit_sphere(UInt &seed) {
+    Float u0 = frand(seed);
+    Float u1 = frand(seed);
+    Float u2 = frand(seed);
+    return sample_in_unit_sphere(make_float3(u0, u1, u2));
 }
 
 Float3 random_in_unit_disk(UInt &seed) {
-    Float3 p;
-    $loop {
-        Float x = frand(seed, -1, 1);
-        Float y = frand(seed, -1, 1);
-        p = make_float3(x, y, 0.0f);
-        $if (length_squared(p) < 1.0f) { $break; };
-    };
-    return p;
+    Float u0 = frand(seed);
+    Float u1 = frand(seed);
+    return sample_unit_disk(make_float2(u0, u1));
+}
+
+Float3 random_cosine_direction(const Float3 &n, UInt &seed) {
+    Float u0 = frand(seed);
+    Float u1 = frand(seed);
+    return sample_cosine_direction(n, make_float2(u0, u1));
 }
 
 Bool near_zero(const Float3& e) {
@@ -104,6 +181,22 @@ Float3 ray_reflect(const Float3 &v, const Float3 &n) {
     return v - 2.0f * dot(v, n) * n;
 }
 
+// Russian roulette on a path that has traced depth rays, from rr_depth rays
+// on (never when rr_depth is 0). Survivors are reweighted so the estimate is
+// unchanged; returns false when the path should stop.
+Bool russian_roulette(Float3 &throughput, const UInt &depth, const UInt &rr_depth, UInt &seed) {
+    Bool alive { true };
+    $if ((rr_depth > 0u) & (depth >= rr_depth)) {
+        Float p = min(max(throughput.x, max(throughput.y, throughput.z)), 0.95f);
+        $if (frand(seed) < p) {
+            throughput /= p;
+        } $else {
+            alive = false;
+        };
+    };
+    return alive;
+}
+
 Float3 ray_refract(const Float3 &uv, const Float3 &n, Float etai_over_etat) {
     Float cos_theta = min(dot(-uv, n), 1.0f);
     Float3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
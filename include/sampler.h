@@ -0,0 +1,203 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <array>
+
+
+enum struct sampler_type {
+    independent,
+    sobol
+};
+
+sampler_type default_sampler { sampler_type::sobol };
+
+// The random numbers of one sample of one pixel, handed out one dimension at
+// a time. Dimensions are counted while the kernel is recorded, so a given
+// call site always gets the same dimension.
+class sampler {
+public:
+    virtual ~sampler() = default;
+
+    [[nodiscard]]
+    virtual Float next_1d() = 0;
+
+    [[nodiscard]]
+    virtual Float2 next_2d() = 0;
+};
+
+// White noise from the LCG state of the camera bounce, which it advances.
+class independent_sampler : public sampler {
+public:
+    explicit independent_sampler(UInt &seed)
+        : seed(seed)
+    {}
+
+    [[nodiscard]]
+    Float next_1d() override {
+        return frand(seed);
+    }
+
+    [[nodiscard]]
+    Float2 next_2d() override {
+        Float x = frand(seed);
+        Float y = frand(seed);
+        return make_float2(x, y);
+    }
+
+private:
+    UInt &seed;
+};
+
+UInt reverse_bits(UInt x) {
+    x = ((x >> 1u) & 0x55555555u) | ((x & 0x55555555u) << 1u);
+    x = ((x >> 2u) & 0x33333333u) | ((x & 0x33333333u) << 2u);
+    x = ((x >> 4u) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4u);
+    x = ((x >> 8u) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8u);
+    return (x >> 16u) | (x << 16u);
+}
+
+// A hash that only lets lower bits affect higher ones, which on reversed bits
+// is an Owen scramble.
+UInt laine_karras_permutation(UInt x, const UInt &seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+UInt nested_uniform_scramble(const UInt &x, const UInt &seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// Generator matrices of the first four Sobol dimensions, one column per bit
+// of the index.
+static constexpr uint sobol_dimensions { 4u };
+static constexpr std::array<uint, sobol_dimensions * 32u> sobol_matrices {
+    0x80000000u, 0x40000000u, 0x20000000u, 0x10000000u, 0x08000000u, 0x04000000u, 0x02000000u, 0x01000000u,
+    0x00800000u, 0x00400000u, 0x00200000u, 0x00100000u, 0x00080000u, 0x00040000u, 0x00020000u, 0x00010000u,
+    0x00008000u, 0x00004000u, 0x00002000u, 0x00001000u, 0x00000800u, 0x00000400u, 0x00000200u, 0x00000100u,
+    0x00000080u, 0x00000040u, 0x00000020u, 0x00000010u, 0x00000008u, 0x00000004u, 0x00000002u, 0x00000001u,
+    0x80000000u, 0xc0000000u, 0xa0000000u, 0xf0000000u, 0x88000000u, 0xcc000000u, 0xaa000000u, 0xff000000u,
+    0x80800000u, 0xc0c00000u, 0xa0a00000u, 0xf0f00000u, 0x88880000u, 0xcccc0000u, 0xaaaa0000u, 0xffff0000u,
+    0x80008000u, 0xc000c000u, 0xa000a000u, 0xf000f000u, 0x88008800u, 0xcc00cc00u, 0xaa00aa00u, 0xff00ff00u,
+    0x80808080u, 0xc0c0c0c0u, 0xa0a0a0a0u, 0xf0f0f0f0u, 0x88888888u, 0xccccccccu, 0xaaaaaaaau, 0xffffffffu,
+    0x80000000u, 0xc0000000u, 0x60000000u, 0x90000000u, 0xe8000000u, 0x5c000000u, 0x8e000000u, 0xc5000000u,
+    0x68800000u, 0x9cc00000u, 0xee600000u, 0x55900000u, 0x80680000u, 0xc09c0000u, 0x60ee0000u, 0x90550000u,
+    0xe8808000u, 0x5cc0c000u, 0x8e606000u, 0xc5909000u, 0x6868e800u, 0x9c9c5c00u, 0xeeee8e00u, 0x5555c500u,
+    0x8000e880u, 0xc0005cc0u, 0x60008e60u, 0x9000c590u, 0xe8006868u, 0x5c009c9cu, 0x8e00eeeeu, 0xc5005555u,
+    0x80000000u, 0xc0000000u, 0x20000000u, 0x50000000u, 0xf8000000u, 0x74000000u, 0xa2000000u, 0x93000000u,
+    0xd8800000u, 0x25400000u, 0x59e00000u, 0xe6d00000u, 0x78080000u, 0xb40c0000u, 0x82020000u, 0xc3050000u,
+    0x208f8000u, 0x51474000u, 0xfbea2000u, 0x75d93000u, 0xa0858800u, 0x914e5400u, 0xdbe79e00u, 0x25db6d00u,
+    0x58800080u, 0xe54000c0u, 0x79e00020u, 0xb6d00050u, 0x800800f8u, 0xc00c0074u, 0x200200a2u, 0x50050093u
+};
+
+// Owen-scrambled Sobol points with hash-based shuffling, after Burley,
+// "Practical Hash-based Owen Scrambling" (JCGT 2020). Dimensions come in
+// groups of four: a group shuffles the sample index once and takes the first
+// four Sobol dimensions of it, each scrambled with its own seed. Seeds hash
+// the pixel and the dimension, so pixels are decorrelated and there is no
+// limit on the number of dimensions. 2D samples never straddle two groups.
+class sobol_sampler : public sampler {
+public:
+    sobol_sampler(const Buffer<uint> &matrices, const UInt2 &pixel, const UInt &sample_index)
+        : matrices(matrices)
+        , pixel_seed(tea(pixel.x, pixel.y))
+        , sample_index(sample_index)
+    {}
+
+    [[nodiscard]]
+    Float next_1d() override {
+        return sample(dimension++);
+    }
+
+    [[nodiscard]]
+    Float2 next_2d() override {
+        dimension += dimension % 2u;
+        Float x = sample(dimension++);
+        Float y = sample(dimension++);
+        return make_float2(x, y);
+    }
+
+private:
+    [[nodiscard]]
+    Float sample(uint dim) const;
+
+private:
+    const Buffer<uint> &matrices;
+    UInt pixel_seed;
+    UInt sample_index;
+    uint dimension { 0u };
+};
+
+Float sobol_sampler::sample(uint dim) const {
+    UInt group_seed = tea(pixel_seed, dim / sobol_dimensions);
+    UInt index = nested_uniform_scramble(sample_index, group_seed);
+
+    // Dimension 0 is the van der Corput sequence, the others multiply the
+    // index bits by their generator matrix.
+    UInt x;
+    uint component = dim % sobol_dimensions;
+    if (component == 0u) {
+        x = reverse_bits(index);
+    } else {
+        x = 0u;
+        UInt bit { 0u };
+        $while (index != 0u) {
+            $if ((index & 1u) != 0u) {
+                x ^= matrices->read(component * 32u + bit);
+            };
+            index >>= 1u;
+            bit += 1u;
+        };
+    }
+
+    x = nested_uniform_scramble(x, tea(group_seed, component));
+    return cast<Float>(x >> 8u) * (1.0f / static_cast<float>(1u << 24u));
+}
+
+// The sampler dimensions of the first path vertex, drawn after the camera's:
+// the light pick and light point of next-event estimation, then the uniform
+// numbers of the BSDF sample. Later vertices draw from their bounce_seed.
+struct first_vertex_samples {
+    Float3 light;
+    Float3 scatter;
+};
+
+first_vertex_samples sample_first_vertex(sampler &smp) {
+    first_vertex_samples ret;
+    Float light_pick = smp.next_1d();
+    ret.light = make_float3(light_pick, smp.next_2d());
+    Float2 scatter_uv = smp.next_2d();
+    ret.scatter = make_float3(scatter_uv, smp.next_1d());
+    return ret;
+}
+
+// Creates the sampler of each sample while a kernel is recorded, holding the
+// device data the sampler type needs.
+class sampler_factory {
+public:
+    sampler_factory(Device &device, Stream &stream, sampler_type type = default_sampler)
+        : type(type)
+    {
+        if (type == sampler_type::sobol) {
+            matrices = device.create_buffer<uint>(sobol_matrices.size());
+            stream << matrices.copy_from(sobol_matrices.data()) << synchronize();
+        }
+    }
+
+    // seed is the bounce_seed of the camera ray, which an independent sampler draws from.
+    [[nodiscard]]
+    luisa::unique_ptr<sampler> create(const UInt2 &pixel, const UInt &sample_index, UInt &seed) const {
+        if (type == sampler_type::sobol) {
+            return luisa::make_unique<sobol_sampler>(matrices, pixel, sample_index);
+        }
+        return luisa::make_unique<independent_sampler>(seed);
+    }
+
+private:
+    sampler_type type;
+    Buffer<uint> matrices;
+};
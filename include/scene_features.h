@@ -0,0 +1,41 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <array>
+
+
+// Optional parts of the renderer, as bits of a mask reported per scene.
+enum struct scene_feature : uint {
+    depth_of_field = 1u << 0u,// the camera has an aperture
+    motion_blur = 1u << 1u,   // a moving_sphere needs shutter times
+    volumes = 1u << 2u,       // constant_medium boundaries and isotropic scattering
+    emissive = 1u << 3u,      // diffuse_light materials
+    textures = 1u << 4u       // non-solid textures
+};
+
+static constexpr uint all_scene_features { (1u << 5u) - 1u };
+
+// Features of the scene whose kernels are being recorded. Code for the others
+// is not emitted, so each feature set compiles to its own kernel variant. All
+// features by default, so kernels recorded without a scene keep every path.
+uint kernel_features { all_scene_features };
+
+inline bool has_feature(scene_feature feature) {
+    return (kernel_features & static_cast<uint>(feature)) != 0u;
+}
+
+// The names of the features in mask, e.g. "motion_blur, textures".
+inline luisa::string describe_features(uint mask) {
+    static constexpr std::array<const char *, 5> names {
+        "depth_of_field", "motion_blur", "volumes", "emissive", "textures"
+    };
+    luisa::string ret;
+    for (uint i = 0u; i < names.size(); i++) {
+        if ((mask & (1u << i)) != 0u) {
+            ret += ret.empty() ? "" : ", ";
+            ret += names[i];
+        }
+    }
+    return ret.empty() ? luisa::string { "none" } : ret;
+}
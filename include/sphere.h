@@ -1,6 +1,7 @@
 #pragma once
 
 #include "hittable.h"
+#include "primitive.h"
 
 
 class sphere : public hittable {
@@ -34,20 +35,19 @@ public:
 
     virtual bool bounding_box(aabb &output_box) const override;
 
-private:
-    static void get_sphere_uv(const Float3 &p, Float &u, Float &v) {
-        // p: a given point on the sphere of radius one, centered at the origin.
-        // u: returned value [0,1] of angle around the Y axis from X=-1.
-        // v: returned value [0,1] of angle from Y=-1 to Y=+1.
-        //     <1 0 0> yields <0.50 0.50>       <-1  0  0> yields <0.00 0.50>
-        //     <0 1 0> yields <0.50 1.00>       < 0 -1  0> yields <0.50 0.00>
-        //     <0 0 1> yields <0.25 0.50>       < 0  0 -1> yields <0.75 0.50>
-
-        auto theta = acos(-p.y);
-        auto phi = atan2(-p.z, p.x) + pi;
+    Bool occluded(
+        const ray &r,
+        Float t_min,
+        Float t_max,
+        UInt &seed
+    ) const override {
+        Float t;
+        return primitive_table::hit_sphere(def(center), def(radius), r, t_min, t_max, t);
+    }
 
-        u = phi / (2 * pi);
-        v = theta / pi;
+    bool pack(primitive_table &table, luisa::vector<uint> &refs) const override {
+        refs.push_back(table.add(sphere_data { center, radius, mat_id }));
+        return true;
     }
 
 public:
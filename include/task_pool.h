@@ -0,0 +1,117 @@
+#pragma once
+
+#include <luisa/core/stl/vector.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+
+// Host threads running fire-and-forget tasks, which may submit more tasks.
+// The thread calling wait() works through the queue as well, so a pool of
+// thread_count threads starts thread_count - 1 workers and a pool of one runs
+// everything on the caller.
+class task_pool {
+public:
+    explicit task_pool(std::size_t thread_count = std::thread::hardware_concurrency());
+    ~task_pool();
+
+    task_pool(const task_pool &) = delete;
+    task_pool &operator=(const task_pool &) = delete;
+
+    void submit(std::function<void()> task);
+
+    // Returns once every submitted task, including those submitted by other
+    // tasks, has finished.
+    void wait();
+
+    [[nodiscard]]
+    std::size_t size() const {
+        return workers.size() + 1u;
+    }
+
+private:
+    void run_worker();
+    void finish_task();
+
+private:
+    luisa::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::size_t pending { 0u };// submitted but not yet finished
+    bool stopping { false };
+};
+
+task_pool::task_pool(std::size_t thread_count) {
+    for (std::size_t i = 1u; i < thread_count; i++) {
+        workers.emplace_back([this] { run_worker(); });
+    }
+}
+
+task_pool::~task_pool() {
+    {
+        std::lock_guard lock { mutex };
+        stopping = true;
+    }
+    changed.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+void task_pool::submit(std::function<void()> task) {
+    {
+        std::lock_guard lock { mutex };
+        tasks.push_back(std::move(task));
+        pending++;
+    }
+    changed.notify_one();
+}
+
+void task_pool::wait() {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock lock { mutex };
+            changed.wait(lock, [this] { return !tasks.empty() || pending == 0u; });
+            if (tasks.empty()) {
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+        finish_task();
+    }
+}
+
+void task_pool::run_worker() {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock lock { mutex };
+            changed.wait(lock, [this] { return !tasks.empty() || stopping; });
+            if (tasks.empty()) {
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+        finish_task();
+    }
+}
+
+void task_pool::finish_task() {
+    bool idle;
+    {
+        std::lock_guard lock { mutex };
+        idle = --pending == 0u;
+    }
+    if (idle) {
+        changed.notify_all();
+    }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "rtweekend.h"
+
+
+// Work done for one camera path, counted by the kernel being recorded while
+// trace_stats points at it.
+struct trace_counters {
+    UInt nodes { 0u };          // linear_bvh nodes visited
+    UInt slab_tests { 0u };     // aabb::hit calls
+    UInt primitive_tests { 0u };// sphere, rect and custom intersection tests
+    UInt bounces { 0u };        // path segments traced
+};
+
+// Counters of the kernel being recorded, or nullptr when it is not
+// instrumented, in which case counting emits no code.
+trace_counters *trace_stats { nullptr };
+
+inline void count_trace(UInt trace_counters::*counter) {
+    if (trace_stats != nullptr) {
+        trace_stats->*counter += 1u;
+    }
+}
@@ -0,0 +1,478 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "ray.h"
+#include "camera.h"
+#include "hittable.h"
+#include "material.h"
+#include "light.h"
+#include "sampler.h"
+#include "accumulator.h"
+
+#include <array>
+
+
+// A camera path between two wavefront kernels. Radiance is gathered forwards:
+// every surface adds its emission weighted by the throughput so far.
+struct path_state {
+    float3 origin;
+    float3 direction;
+    float3 throughput;
+    float3 radiance;
+    float time;
+    float bsdf_pdf;// density direction was sampled with, 0 from the camera and specular bounces
+    float3 light_sample;// first_vertex_samples of the path, used at depth 0
+    float3 scatter_sample;
+    uint key;// sample_key of the path
+    uint seed;// bounce_seed of the current bounce, advanced by frand
+    uint depth;// rays traced so far
+};
+
+LUISA_STRUCT(path_state, origin, direction, throughput, radiance, time, bsdf_pdf, light_sample, scatter_sample, key, seed, depth) {};
+
+// The closest hit of a path, written by intersect and read by shade.
+struct path_hit {
+    float3 p;
+    float3 normal;
+    float t;
+    float u;
+    float v;
+    uint mat_id;
+    bool front_face;
+};
+
+LUISA_STRUCT(path_hit, p, normal, t, u, v, mat_id, front_face) {};
+
+// Queue entries are sorted on keys of sort_key_bits by a least significant
+// digit radix sort, sort_radix_bits per pass. The count, scan and scatter
+// kernels each give one thread a block of sort_block_size values.
+static constexpr uint sort_key_bits { 11u };
+static constexpr uint sort_radix_bits { 4u };
+static constexpr uint sort_radix { 1u << sort_radix_bits };
+static constexpr uint sort_pass_count { (sort_key_bits + sort_radix_bits - 1u) / sort_radix_bits };
+static constexpr uint sort_block_size { 256u };
+static_assert(material_type_count <= 8u, "sort keys hold the material type in 3 bits");
+
+
+// Path tracing split into generate, intersect, shade and accumulate kernels
+// that pass work through device queues of path indices. Each bounce dispatches
+// intersect over the paths still alive and shade over those that hit, so no
+// thread idles on a finished path and each kernel only holds the state of its
+// own stage. The only host round trip per bounce reads back the queue sizes.
+//
+// With sort_queues, both queues are reordered before they are consumed, so
+// that neighbouring threads do similar work. Both use one key: the material
+// type, then the direction octant and origin cell. Hits are keyed on the
+// material they hit, so shade threads run the same material code; rays on the
+// material that scattered them, which groups rays of similar directions and
+// origins for intersect. Keys are written along with the queue entries and
+// sorted by a stable radix sort, each pass counting digits per block, taking a
+// hierarchical prefix sum of the counts and scattering the blocks in order.
+class wavefront_renderer {
+public:
+    wavefront_renderer(
+        Device &device,
+        Stream &stream,
+        const hittable &world,
+        const material_table &mats,
+        const light_list &lights,
+        const camera &cam,
+        const sampler_factory &samplers,
+        const accumulator &accum,
+        const float3 &background,
+        uint max_depth,
+        uint rr_depth,
+        uint2 resolution,
+        bool sort_queues = false
+    );
+
+    // Adds one sample per pixel to accum; returns the number of rays traced.
+    std::size_t render(uint sample_index);
+
+private:
+    // Sorts entries [0, queue_sizes[size_index]) of queue by queue_keys and
+    // returns the buffer holding them, queue or the scratch queue. The scratch
+    // queue is shared, so each sorted queue must be consumed before the next
+    // sort.
+    Buffer<uint> &sort(Buffer<uint> &queue, uint size_index, uint capacity);
+
+    // Exclusive prefix sum of the first count values of scan_levels[level],
+    // using the levels above it for the sums of its blocks.
+    void scan(uint level, uint count);
+
+private:
+    Stream &stream;
+    uint2 resolution;
+    uint max_depth;
+    uint rr_depth;
+    bool sort_queues;
+
+    Buffer<path_state> path_buffer;// one path per pixel
+    Buffer<path_hit> hit_buffer;
+    std::array<Buffer<uint>, 2> ray_queues;// the current bounce and the next one
+    Buffer<uint> hit_queue;
+    Buffer<uint> queue_sizes;// 0: hit queue, 1: next ray queue
+    std::array<uint, 2> host_queue_sizes {};
+    std::array<uint, 2> zero_queue_sizes {};
+
+    Buffer<uint> queue_keys;// key of each entry of the queue being filled
+    Buffer<uint> sorted_queue;// scratch queues the sort passes alternate with
+    Buffer<uint> sorted_keys;
+    luisa::vector<Buffer<uint>> scan_levels;// 0: digit counts of all blocks, then block sums
+    Buffer<uint> scan_zero;
+
+    Shader2D<uint> generate;
+    Shader1D<Buffer<uint>> intersect;
+    Shader1D<Buffer<uint>, Buffer<uint>, uint, uint> shade;
+    Shader2D<uint> accumulate;
+    Shader1D<Buffer<uint>, Buffer<uint>, uint, uint, uint> count_digits;
+    Shader1D<Buffer<uint>, Buffer<uint>, uint> reduce_blocks;
+    Shader1D<Buffer<uint>, Buffer<uint>, uint> scan_blocks;
+    Shader1D<Buffer<uint>, Buffer<uint>, Buffer<uint>, Buffer<uint>, Buffer<uint>, uint, uint, uint> scatter_digits;
+};
+
+wavefront_renderer::wavefront_renderer(
+    Device &device,
+    Stream &stream,
+    const hittable &world,
+    const material_table &mats,
+    const light_list &lights,
+    const camera &cam,
+    const sampler_factory &samplers,
+    const accumulator &accum,
+    const float3 &background,
+    uint max_depth,
+    uint rr_depth,
+    uint2 resolution,
+    bool sort_queues
+)
+    : stream(stream)
+    , resolution(resolution)
+    , max_depth(max_depth)
+    , rr_depth(rr_depth)
+    , sort_queues(sort_queues)
+{
+    auto path_count = resolution.x * resolution.y;
+    path_buffer = device.create_buffer<path_state>(path_count);
+    hit_buffer = device.create_buffer<path_hit>(path_count);
+    ray_queues[0] = device.create_buffer<uint>(path_count);
+    ray_queues[1] = device.create_buffer<uint>(path_count);
+    hit_queue = device.create_buffer<uint>(path_count);
+    queue_sizes = device.create_buffer<uint>(2u);
+    if (sort_queues) {
+        queue_keys = device.create_buffer<uint>(path_count);
+        sorted_queue = device.create_buffer<uint>(path_count);
+        sorted_keys = device.create_buffer<uint>(path_count);
+
+        // Level 0 holds the digit counts of every block of the largest
+        // queue, each level above one sum per block of the level below.
+        uint scan_size = sort_radix * ((path_count + sort_block_size - 1u) / sort_block_size);
+        scan_levels.push_back(device.create_buffer<uint>(scan_size));
+        while (scan_size > sort_block_size) {
+            scan_size = (scan_size + sort_block_size - 1u) / sort_block_size;
+            scan_levels.push_back(device.create_buffer<uint>(scan_size));
+        }
+        uint zero { 0u };
+        scan_zero = device.create_buffer<uint>(1u);
+        stream << scan_zero.copy_from(&zero) << synchronize();
+    }
+
+    // The material type in bits 8 to 10, the direction octant in bits 5 to 7
+    // and a hash of the cell of a 4x4x4 grid over the scene holding the
+    // origin in bits 0 to 4.
+    aabb scene_box;
+    bool has_scene_box = world.bounding_box(scene_box);
+    float3 cell_size = (scene_box.max() - scene_box.min()) / 4.0f;
+    auto sort_key = [&](const UInt &mat_id, const Float3 &origin, const Float3 &direction) {
+        UInt octant = ite(direction.x < 0.0f, 1u, 0u)
+            | ite(direction.y < 0.0f, 2u, 0u)
+            | ite(direction.z < 0.0f, 4u, 0u);
+        UInt cell { 0u };
+        if (has_scene_box) {
+            Int3 c = make_int3(floor((origin - scene_box.min()) / cell_size));
+            cell = (cast<UInt>(c.x) * 73856093u ^ cast<UInt>(c.y) * 19349663u ^ cast<UInt>(c.z) * 83492791u) & 31u;
+        }
+        return (mats.type(mat_id) << 8u) | (octant << 5u) | cell;
+    };
+
+    Kernel2D generate_kernel = [&](UInt sample_index) {
+        UInt2 coord = dispatch_id().xy();
+        UInt2 size = dispatch_size().xy();
+        UInt index = coord.y * size.x + coord.x;
+
+        UInt key = sample_key(coord, sample_index);
+        UInt seed = bounce_seed(key, 0u);
+        auto smp = samplers.create(coord, sample_index, seed);
+        Float2 jitter = smp->next_2d();
+        Float2 uv = make_float2(
+            (cast<Float>(coord.x) + jitter.x) / (cast<Float>(size.x) - 1.0f),
+            (cast<Float>(size.y - 1u - coord.y) + jitter.y) / (cast<Float>(size.y) - 1.0f)
+        );
+        ray r = cam.get_ray(uv, *smp);
+        first_vertex_samples first_samples = sample_first_vertex(*smp);
+
+        Var<path_state> path;
+        path.origin = r.origin();
+        path.direction = r.direction();
+        path.throughput = make_float3(1.0f);
+        path.radiance = make_float3(0.0f);
+        path.time = r.time();
+        path.bsdf_pdf = 0.0f;
+        path.light_sample = first_samples.light;
+        path.scatter_sample = first_samples.scatter;
+        path.key = key;
+        path.seed = bounce_seed(key, 1u);
+        path.depth = 0u;
+        path_buffer->write(index, path);
+        ray_queues[0]->write(index, index);
+    };
+
+    Kernel1D intersect_kernel = [&](BufferUInt ray_queue) {
+        UInt index = ray_queue.read(dispatch_x());
+        Var<path_state> path = path_buffer->read(index);
+        ray r(path.origin, path.direction, path.time);
+        UInt seed = path.seed;
+
+        hit_record rec;
+        $if (world.hit(r, 0.001f, infinity, rec, seed)) {
+            Var<path_hit> h;
+            h.p = rec.p;
+            h.normal = rec.normal;
+            h.t = rec.t;
+            h.u = rec.u;
+            h.v = rec.v;
+            h.mat_id = rec.mat_id;
+            h.front_face = rec.front_face;
+            hit_buffer->write(index, h);
+            UInt slot = queue_sizes->atomic(0u).fetch_add(1u);
+            hit_queue->write(slot, index);
+            if (sort_queues) {
+                queue_keys->write(slot, sort_key(rec.mat_id, rec.p, r.direction()));
+            }
+        } $else {
+            path.radiance += path.throughput * background;
+        };
+
+        path.seed = seed;
+        path_buffer->write(index, path);
+    };
+
+    // Dispatched over the rays of the bounce, which bound the hits.
+    Kernel1D shade_kernel = [&](BufferUInt hits, BufferUInt next_ray_queue, UInt max_depth, UInt rr_depth) {
+        $if (dispatch_x() < queue_sizes->read(0u)) {
+            UInt index = hits.read(dispatch_x());
+            Var<path_state> path = path_buffer->read(index);
+            Var<path_hit> h = hit_buffer->read(index);
+            ray r(path.origin, path.direction, path.time);
+            UInt seed = path.seed;
+
+            hit_record rec;
+            rec.p = h.p;
+            rec.normal = h.normal;
+            rec.t = h.t;
+            rec.u = h.u;
+            rec.v = h.v;
+            rec.mat_id = h.mat_id;
+            rec.front_face = h.front_face;
+
+            ray scattered;
+            Float3 attenuation;
+            Float3 emitted;
+            Bool has_scatter { false };
+            Float pdf;
+            // The same sampler dimensions as the megakernel at the first vertex.
+            Float3 scatter_sample = ite(path.depth == 0u, path.scatter_sample, random_float3(seed));
+            mats.evaluate(rec.mat_id, r, rec, emitted, attenuation, scattered, has_scatter, pdf, scatter_sample);
+            if (!lights.empty()) {
+                emitted *= lights.emission_weight(r, rec, path.bsdf_pdf);
+                // No next-event estimation at the last vertex, as in ray_color.
+                $if (mats.is_diffuse(rec.mat_id) & (path.depth + 1u < max_depth)) {
+                    Float3 light_sample = ite(path.depth == 0u, path.light_sample, random_float3(seed));
+                    path.radiance += path.throughput * lights.sample_direct(world, mats, r, rec, light_sample, seed);
+                };
+            }
+
+            if (has_feature(scene_feature::emissive)) {
+                path.radiance += path.throughput * emitted;
+            }
+            $if (has_scatter & (path.depth + 1u < max_depth)) {
+                path.throughput *= attenuation;
+                path.bsdf_pdf = pdf;
+                path.depth += 1u;
+                $if (russian_roulette(path.throughput, path.depth, rr_depth, seed)) {
+                    path.origin = scattered.origin();
+                    path.direction = scattered.direction();
+                    path.time = scattered.time();
+                    UInt slot = queue_sizes->atomic(1u).fetch_add(1u);
+                    next_ray_queue.write(slot, index);
+                    if (sort_queues) {
+                        queue_keys->write(slot, sort_key(rec.mat_id, path.origin, path.direction));
+                    }
+                };
+            };
+
+            path.seed = bounce_seed(path.key, path.depth + 1u);
+            path_buffer->write(index, path);
+        };
+    };
+
+    Kernel2D accumulate_kernel = [&](UInt sample_index) {
+        UInt2 coord = dispatch_id().xy();
+        UInt index = coord.y * dispatch_size().x + coord.x;
+        accumulation acc = accum.load(coord, sample_index);
+        accum.add(acc, path_buffer->read(index).radiance);
+        accum.store(coord, acc);
+    };
+
+    // Counts the digits at shift of the keys of one block of the queue. The
+    // counts are stored digit-major, so that their exclusive prefix sum gives
+    // each block the first slot of each digit, after all smaller digits and
+    // after the same digit in the blocks before it.
+    Kernel1D count_kernel = [&](BufferUInt keys, BufferUInt block_counts, UInt size_index, UInt shift, UInt block_count) {
+        UInt block = dispatch_x();
+        UInt begin = block * sort_block_size;
+        UInt end = min(begin + sort_block_size, queue_sizes->read(size_index));
+        ArrayUInt<sort_radix> counts;
+        $for (digit, 0u, sort_radix) {
+            counts[digit] = 0u;
+        };
+        $for (i, begin, end) {
+            UInt digit = (keys.read(i) >> shift) & (sort_radix - 1u);
+            counts[digit] += 1u;
+        };
+        $for (digit, 0u, sort_radix) {
+            block_counts.write(digit * block_count + block, counts[digit]);
+        };
+    };
+
+    // The sum of each block of values, for the level above.
+    Kernel1D reduce_kernel = [&](BufferUInt values, BufferUInt block_sums, UInt count) {
+        UInt begin = dispatch_x() * sort_block_size;
+        UInt end = min(begin + sort_block_size, count);
+        UInt sum { 0u };
+        $for (i, begin, end) {
+            sum += values.read(i);
+        };
+        block_sums.write(dispatch_x(), sum);
+    };
+
+    // Exclusive prefix sum within each block of values, starting from the
+    // scanned sum of the blocks before it.
+    Kernel1D block_scan_kernel = [&](BufferUInt values, BufferUInt block_offsets, UInt count) {
+        UInt begin = dispatch_x() * sort_block_size;
+        UInt end = min(begin + sort_block_size, count);
+        UInt sum = block_offsets.read(dispatch_x());
+        $for (i, begin, end) {
+            UInt value = values.read(i);
+            values.write(i, sum);
+            sum += value;
+        };
+    };
+
+    // Moves each block to the slots of its digits, in queue order, which keeps
+    // the sort stable from one pass to the next.
+    Kernel1D scatter_kernel = [&](
+        BufferUInt queue,
+        BufferUInt keys,
+        BufferUInt digit_offsets,
+        BufferUInt sorted,
+        BufferUInt sorted_keys,
+        UInt size_index,
+        UInt shift,
+        UInt block_count
+    ) {
+        UInt block = dispatch_x();
+        UInt begin = block * sort_block_size;
+        UInt end = min(begin + sort_block_size, queue_sizes->read(size_index));
+        ArrayUInt<sort_radix> slots;
+        $for (digit, 0u, sort_radix) {
+            slots[digit] = digit_offsets.read(digit * block_count + block);
+        };
+        $for (i, begin, end) {
+            UInt key = keys.read(i);
+            UInt digit = (key >> shift) & (sort_radix - 1u);
+            UInt slot = slots[digit];
+            slots[digit] = slot + 1u;
+            sorted.write(slot, queue.read(i));
+            sorted_keys.write(slot, key);
+        };
+    };
+
+    generate = device.compile(generate_kernel);
+    intersect = device.compile(intersect_kernel);
+    shade = device.compile(shade_kernel);
+    accumulate = device.compile(accumulate_kernel, accum.shader_option());
+    if (sort_queues) {
+        count_digits = device.compile(count_kernel);
+        reduce_blocks = device.compile(reduce_kernel);
+        scan_blocks = device.compile(block_scan_kernel);
+        scatter_digits = device.compile(scatter_kernel);
+    }
+}
+
+Buffer<uint> &wavefront_renderer::sort(Buffer<uint> &queue, uint size_index, uint capacity) {
+    // Blocks past the queue size count nothing, so capacity bounds the work.
+    uint block_count = (capacity + sort_block_size - 1u) / sort_block_size;
+    std::array<Buffer<uint> *, 2> queues { &queue, &sorted_queue };
+    std::array<Buffer<uint> *, 2> keys { &queue_keys, &sorted_keys };
+    for (uint pass = 0u; pass < sort_pass_count; pass++) {
+        uint from = pass % 2u;
+        uint shift = pass * sort_radix_bits;
+        stream << count_digits(*keys[from], scan_levels[0], size_index, shift, block_count).dispatch(block_count);
+        scan(0u, sort_radix * block_count);
+        stream << scatter_digits(
+            *queues[from],
+            *keys[from],
+            scan_levels[0],
+            *queues[1u - from],
+            *keys[1u - from],
+            size_index,
+            shift,
+            block_count
+        ).dispatch(block_count);
+    }
+    return *queues[sort_pass_count % 2u];
+}
+
+void wavefront_renderer::scan(uint level, uint count) {
+    uint block_count = (count + sort_block_size - 1u) / sort_block_size;
+    if (block_count == 1u) {
+        stream << scan_blocks(scan_levels[level], scan_zero, count).dispatch(1u);
+        return;
+    }
+    stream << reduce_blocks(scan_levels[level], scan_levels[level + 1u], count).dispatch(block_count);
+    scan(level + 1u, block_count);
+    stream << scan_blocks(scan_levels[level], scan_levels[level + 1u], count).dispatch(block_count);
+}
+
+std::size_t wavefront_renderer::render(uint sample_index) {
+    std::size_t ray_count { 0u };
+    uint current { 0u };
+    uint queue_size = resolution.x * resolution.y;
+    Buffer<uint> *rays = &ray_queues[0];
+
+    stream << generate(sample_index).dispatch(resolution);
+    for (uint depth = 0u; depth < max_depth && queue_size > 0u; depth++) {
+        ray_count += queue_size;
+        stream << queue_sizes.copy_from(zero_queue_sizes.data());
+
+        stream << intersect(*rays).dispatch(queue_size);
+        Buffer<uint> *hits = &hit_queue;
+        if (sort_queues) {
+            hits = &sort(hit_queue, 0u, queue_size);
+        }
+
+        current = 1u - current;
+        stream << shade(*hits, ray_queues[current], max_depth, rr_depth).dispatch(queue_size);
+        rays = &ray_queues[current];
+        if (sort_queues) {
+            rays = &sort(ray_queues[current], 1u, queue_size);
+        }
+
+        stream << queue_sizes.copy_to(host_queue_sizes.data()) << synchronize();
+        queue_size = host_queue_sizes[1];
+    }
+    stream << accumulate(sample_index).dispatch(resolution);
+
+    return ray_count;
+}
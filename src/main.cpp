@@ -9,19 +9,34 @@
 #include <aarect.h>
 #include <box.h>
 #include <constant_medium.h>
+#include <instance.h>
+#include <accel_world.h>
+#include <light.h>
+#include <accumulator.h>
+#include <sampler.h>
+#include <trace_stats.h>
+#include <wavefront.h>
 
 #include <luisa/core/clock.h>
 #include <cxxopts.hpp>
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <string>
+#include <utility>
 #include <exception> // std::exception
 
-#define MAX_DEPTH 50
-
 
 namespace {
 
-hittable_list random_scene();
+hittable_list random_scene(Device &d, Stream &s);
 hittable_list two_spheres();
 hittable_list two_perlin_spheres(Device &d, Stream &s);
 hittable_list earth(Device &d, Stream &s);
@@ -30,14 +45,88 @@ hittable_list cornell_box();
 hittable_list cornell_smoke();
 hittable_list final_scene(Device &d, Stream &s);
 
+[[nodiscard]]
+uint detect_scene_features(const hittable_list &world, const material_table &mats, const camera &cam);
+
+// Checks the features detected in scenes with known contents.
+void check_scene_features(Device &device, Stream &stream);
+
+// Checks that the kahan format keeps precision the sum format loses.
+void check_accumulation(Device &device, Stream &stream);
+
 Float3 ray_color(
     const ray &r_,
     Float3 background,
     const hittable &world,
+    const material_table &mats,
+    const light_list &lights,
     UInt max_depth,
-    UInt &seed
+    UInt rr_depth,
+    const first_vertex_samples &first_samples,
+    const UInt &key,
+    UInt &ray_count
+);
+
+void write_ppm_tile(
+    std::ofstream &file,
+    uint2 resolution,
+    uint2 tile_offset,
+    uint2 tile_extent,
+    uint tile_width,
+    const luisa::vector<std::byte> &tile_image
+);
+
+[[nodiscard]]
+luisa::vector<std::byte> load_rmse_reference(const luisa::string &filename, uint2 resolution);
+
+// RMSE over the color channels of two RGBA8 images, in [0, 1] units.
+[[nodiscard]]
+double image_rmse(const luisa::vector<std::byte> &image, const luisa::vector<std::byte> &reference);
+
+// Counters are divided by the samples of each pixel: samples_per_pixel, or
+// with adaptive sampling the count moment_image holds.
+void report_trace_stats(
+    Stream &stream,
+    Image<uint> &stats_image,
+    Image<float> *moment_image,
+    uint2 resolution,
+    std::size_t samples_per_pixel,
+    double render_time,
+    const luisa::string &outfile
+);
+
+// Centers and radii of count spheres in a cube growing with the count, so
+// the density stays the same whatever the count.
+struct random_spheres {
+    float extent;// side of the cube
+    luisa::vector<float3> centers;
+    luisa::vector<float> radii;
+};
+
+[[nodiscard]]
+random_spheres make_random_spheres(std::size_t count);
+
+// A kernel tracing, for each thread and frame, one ray from a random point
+// of box in a random direction through world. Hits are counted into
+// counts[counter], and with counted the slab tests into counts[counter + 1].
+[[nodiscard]]
+Shader1D<uint> compile_random_trace(
+    Device &device,
+    const hittable &world,
+    const aabb &box,
+    Buffer<uint> &counts,
+    uint counter,
+    bool counted
 );
 
+void bench_bvh_build();
+
+void bench_refit(Device &device, Stream &stream);
+
+void bench_traversal(Device &device, Stream &stream);
+
+void bench_sampling(Device &device, Stream &stream);
+
 [[nodiscard]]
 cxxopts::ParseResult parse_cli_options(
     int argc,
@@ -50,18 +139,81 @@ cxxopts::ParseResult parse_cli_options(
 int main(int argc, char *argv[]) {
     luisa::string_view program_name = argv[0];
     auto options = parse_cli_options(argc, argv);
+    if (options["bench-bvh-build"].as<bool>()) {
+        bench_bvh_build();
+        return 0;
+    }
+
     auto backend_name = options["backend"].as<luisa::string>();
 
     // Init
     Context context { program_name };
     Device device = context.create_device(backend_name);
     Stream stream = device.create_stream();
+    if (options["bench-refit"].as<bool>()) {
+        bench_refit(device, stream);
+        return 0;
+    }
+    if (options["bench-traversal"].as<bool>()) {
+        bench_traversal(device, stream);
+        return 0;
+    }
+    if (options["bench-sampling"].as<bool>()) {
+        bench_sampling(device, stream);
+        return 0;
+    }
+    if (options["check-scene-features"].as<bool>()) {
+        check_scene_features(device, stream);
+        return 0;
+    }
+    if (options["check-accumulation"].as<bool>()) {
+        check_accumulation(device, stream);
+        return 0;
+    }
 
     // Image
     float aspect_ratio = 16.0f / 9.0f;
     uint image_width = 1920;
     std::size_t samples_per_pixel = options["samples"].as<std::size_t>();
-    uint max_depth = MAX_DEPTH;
+
+    // With --time-limit, rendering stops once the budget runs out and
+    // --samples only bounds it when given explicitly.
+    auto time_limit = options["time-limit"].as<double>();
+    auto checkpoint_interval = options["checkpoint-interval"].as<double>();
+    if (time_limit > 0.0 && options.count("samples") == 0u) {
+        samples_per_pixel = std::numeric_limits<std::size_t>::max();
+    }
+    uint max_depth = options["max-depth"].as<uint>();
+    uint rr_depth = options["rr-depth"].as<uint>();
+
+    auto bvh_method = options["bvh"].as<luisa::string>();
+    if (bvh_method == "sah") {
+        default_bvh_build_method = bvh_build_method::sah;
+    } else if (bvh_method != "median") {
+        LUISA_ERROR("Unknown BVH builder '{}'.", bvh_method);
+    }
+    auto sampler_name = options["sampler"].as<luisa::string>();
+    if (sampler_name == "independent") {
+        default_sampler = sampler_type::independent;
+    } else if (sampler_name != "sobol") {
+        LUISA_ERROR("Unknown sampler '{}'.", sampler_name);
+    }
+    auto accumulation_name = options["accumulation"].as<luisa::string>();
+    if (accumulation_name == "sum") {
+        default_accumulation_format = accumulation_format::sum;
+    } else if (accumulation_name == "half") {
+        default_accumulation_format = accumulation_format::half;
+    } else if (accumulation_name == "kahan") {
+        default_accumulation_format = accumulation_format::kahan;
+    } else if (accumulation_name == "double-float") {
+        default_accumulation_format = accumulation_format::double_float;
+    } else if (accumulation_name != "mean") {
+        LUISA_ERROR("Unknown accumulation format '{}'.", accumulation_name);
+    }
+    default_bvh_width = options["bvh-width"].as<uint>();
+    if (default_bvh_width != 2u && default_bvh_width != 4u && default_bvh_width != 8u) {
+        LUISA_ERROR("Unsupported BVH width {}.", default_bvh_width);
+    }
 
     // World
     hittable_list world;
@@ -75,7 +227,7 @@ int main(int argc, char *argv[]) {
     // select scene
     switch (options["scene"].as<int>()) {
         case 1: {
-            world = random_scene();
+            world = random_scene(device, stream);
             background = float3 { 0.70f, 0.80f, 1.00f };
             lookfrom = float3 { 13.0f, 2.0f, 3.0f };
             lookat = float3 { 0.0f, 0.0f, 0.0f };
@@ -149,6 +301,29 @@ int main(int argc, char *argv[]) {
         default: {}
     }
 
+    // Emitters sampled by next-event estimation; none with --no-nee.
+    light_list lights;
+    if (!options["no-nee"].as<bool>()) {
+        lights.collect(world);
+    }
+
+    // Intersect through the backend's acceleration structure, or through the
+    // typed primitive buffers and linear BVHs.
+    luisa::unique_ptr<accel_world> accel;
+    if (options["accel"].as<bool>()) {
+        accel = luisa::make_unique<accel_world>(device, stream, world);
+    } else {
+        world.build(device, stream);
+    }
+    const hittable &scene = accel != nullptr
+        ? static_cast<const hittable &>(*accel)
+        : world;
+
+    // Materials are registered while the scene is built.
+    material_table mats(device, stream);
+    lights.upload(device, stream);
+    sampler_factory samplers(device, stream);
+
     // Camera
     float3 vup { 0.0f, 1.0f, 0.0f };
     float dist_to_focus { 10.0f };
@@ -164,91 +339,431 @@ int main(int argc, char *argv[]) {
         1.0f
     );
 
+    // Kernels recorded from here on leave out what the scene does not use.
+    kernel_features = detect_scene_features(world, mats, cam);
+    LUISA_INFO("Scene features: {}.", describe_features(kernel_features));
+
     // Render
     uint image_height = static_cast<uint>(static_cast<float>(image_width) / aspect_ratio);
     uint2 resolution = make_uint2(image_width, image_height);
-    Image<uint> seed_image = device.create_image<uint>(PixelStorage::INT1, resolution, 1u, false, false);
-    Image<float> accum_image = device.create_image<float>(PixelStorage::FLOAT4, resolution, 1u, false, false);
-    luisa::vector<std::byte> host_image(accum_image.view().size_bytes());
+
+    // With --tile-size, the megakernel renders tiles of at most that many
+    // pixels square through images of one tile, so device and host memory no
+    // longer grow with the resolution.
+    uint tile_size = options["tile-size"].as<uint>();
+    bool tiled = tile_size > 0u;
+    uint2 tile_resolution = tiled ? luisa::min(resolution, make_uint2(tile_size)) : resolution;
+    accumulator accum(device, tile_resolution);
+    LUISA_INFO(
+        "Accumulation: {}, {} bytes per pixel, {:.1f} MB.",
+        accum.name(),
+        accum.bytes_per_pixel(),
+        static_cast<double>(accum.size_bytes()) * 1e-6
+    );
+    luisa::vector<std::byte> host_image(static_cast<std::size_t>(tile_resolution.x) * tile_resolution.y * 4u);
+
+    // Rays traced, spread over a few counters to keep atomic contention low.
+    static constexpr uint ray_counter_count = 64u;
+    Buffer<uint> ray_counter = device.create_buffer<uint>(ray_counter_count);
+    luisa::vector<uint> host_ray_counter(ray_counter_count, 0u);
+    stream << ray_counter.copy_from(host_ray_counter.data());
+
+    // Per-pixel trace_counters summed over all samples, only recorded with --stats.
+    bool collect_stats = options["stats"].as<bool>();
+    if (collect_stats && tiled) {
+        LUISA_WARNING("--stats needs the whole image and is ignored with --tile-size.");
+        collect_stats = false;
+    }
+    Image<uint> stats_image = device.create_image<uint>(
+        PixelStorage::INT4,
+        collect_stats ? resolution : make_uint2(1u),
+        1u,
+        false,
+        false
+    );
+
+    // With --adaptive-threshold or --noise-target, the mean luminance, its
+    // second moment, the sample count and the relative error of each pixel.
+    // Pixels stop sampling once their relative error is below the threshold,
+    // and every dispatch sums the pixels still sampling and the errors of all
+    // pixels into adaptive_counter, in units of 1 / adaptive_error_scale.
+    auto adaptive_threshold = options["adaptive-threshold"].as<float>();
+    auto noise_target = options["noise-target"].as<float>();
+    auto min_samples = options["min-samples"].as<uint>();
+    bool adaptive = adaptive_threshold > 0.0f || noise_target > 0.0f;
+    static constexpr float adaptive_error_scale = 1024.0f;
+    Image<float> moment_image = device.create_image<float>(
+        PixelStorage::FLOAT4,
+        adaptive ? tile_resolution : make_uint2(1u),
+        1u,
+        false,
+        false
+    );
+    Buffer<uint> adaptive_counter = device.create_buffer<uint>(2u * ray_counter_count);
+    luisa::vector<uint> host_adaptive_counter(2u * ray_counter_count, 0u);
+    luisa::vector<uint> zero_adaptive_counter(2u * ray_counter_count, 0u);
 
     Kernel2D render_kernel = [&](
-        ImageUInt seed_image,
-        ImageFloat accum_image,
-        UInt sample_index
+        ImageUInt stats_image,
+        ImageFloat moment_image,
+        UInt2 tile_offset,
+        UInt2 image_size,
+        UInt sample_index,
+        UInt sample_count,
+        UInt max_depth,
+        UInt rr_depth,
+        Float adaptive_threshold,
+        UInt min_samples
     ) {
+        // coord addresses the tile images, pixel the whole image.
         UInt2 coord = dispatch_id().xy();
-        UInt2 size = dispatch_size().xy();
-        $if (sample_index == 0u) {
-            seed_image.write(
-                coord,
-                make_uint4(tea(coord.x, coord.y))
-            );
-            accum_image.write(
-                coord,
-                make_float4(make_float3(0.0f), 1.0f)
-            );
-        };
+        UInt2 pixel = tile_offset + coord;
+        UInt2 size = image_size;
+
+        // Samples [sample_index, sample_index + sample_count) of this pixel, or
+        // with adaptive sampling sample_count more unless it has converged.
+        Bool active { true };
+        UInt first_sample = sample_index;
+        Float4 moments = make_float4(0.0f);
+        if (adaptive) {
+            $if (sample_index > 0u) {
+                moments = moment_image.read(coord);
+            };
+            first_sample = cast<UInt>(moments.z);
+            active = (first_sample < min_samples) | (moments.w > adaptive_threshold);
+        }
 
-        UInt seed = seed_image.read(coord).x;
-        Float2 uv = make_float2(
-            (cast<Float>(coord.x) + frand(seed)) / (cast<Float>(size.x) - 1.0f),
-            (cast<Float>(size.y - 1u - coord.y) + frand(seed)) / (cast<Float>(size.y) - 1.0f)
-        );
-        ray r = cam.get_ray(uv, seed);
-        Float3 pixel_color = ray_color(r, background, world, max_depth, seed);
+        $if (active) {
+            accumulation acc = accum.load(coord, first_sample);
+            trace_counters counters;
+            if (collect_stats) {
+                trace_stats = &counters;
+            }
+            UInt ray_count { 0u };
+            $for (s, 0u, sample_count) {
+                UInt key = sample_key(pixel, first_sample + s);
+                UInt seed = bounce_seed(key, 0u);
+                auto smp = samplers.create(pixel, first_sample + s, seed);
+                Float2 jitter = smp->next_2d();
+                Float2 uv = make_float2(
+                    (cast<Float>(pixel.x) + jitter.x) / (cast<Float>(size.x) - 1.0f),
+                    (cast<Float>(size.y - 1u - pixel.y) + jitter.y) / (cast<Float>(size.y) - 1.0f)
+                );
+                ray r = cam.get_ray(uv, *smp);
+                first_vertex_samples first_samples = sample_first_vertex(*smp);
+                Float3 pixel_color = ray_color(
+                    r, background, scene, mats, lights, max_depth, rr_depth, first_samples, key, ray_count);
+                accum.add(acc, pixel_color);
+                if (adaptive) {
+                    Float weight = 1.0f / (cast<Float>(first_sample + s) + 1.0f);
+                    Float luminance = dot(pixel_color, make_float3(0.2126f, 0.7152f, 0.0722f));
+                    moments = make_float4(
+                        lerp(moments.xy(), make_float2(luminance, luminance * luminance), weight),
+                        moments.zw()
+                    );
+                }
+            };
+            ray_counter->atomic(coord.x % ray_counter_count).fetch_add(ray_count);
+            trace_stats = nullptr;
+
+            if (collect_stats) {
+                UInt4 stats = make_uint4(counters.nodes, counters.slab_tests, counters.primitive_tests, counters.bounces);
+                $if (sample_index > 0u) {
+                    stats += stats_image.read(coord);
+                };
+                stats_image.write(coord, stats);
+            }
 
-        Float3 accum_color = lerp(
-            accum_image.read(coord).xyz(),
-            pixel_color,
-            1.0f / (cast<Float>(sample_index) + 1.0f)
-        );
-        accum_image.write(
-            coord,
-            make_float4(accum_color, 1.0f)
-        );
-        seed_image.write(
-            coord,
-            make_uint4(seed)
-        );
+            // Relative standard error of the mean luminance, against at least
+            // 0.01 so that near black pixels are not sampled forever.
+            if (adaptive) {
+                Float n = cast<Float>(first_sample + sample_count);
+                Float variance = max(moments.y - moments.x * moments.x, 0.0f) * n / max(n - 1.0f, 1.0f);
+                moments = make_float4(moments.xy(), n, sqrt(variance / n) / max(moments.x, 0.01f));
+                moment_image.write(coord, moments);
+                adaptive_counter->atomic(coord.x % ray_counter_count).fetch_add(1u);
+            }
+
+            accum.store(coord, acc);
+        };
+
+        if (adaptive) {
+            adaptive_counter->atomic(ray_counter_count + coord.x % ray_counter_count)
+                .fetch_add(cast<UInt>(min(moments.w, 4.0f) * adaptive_error_scale));
+        }
     };
 
-    auto render = device.compile(render_kernel);
+    // Either the megakernel above or separate kernels passing paths through
+    // queues, see wavefront.h.
+    luisa::unique_ptr<wavefront_renderer> wavefront;
+    decltype(device.compile(render_kernel)) render;
+    bool sort_rays = options["sort-rays"].as<bool>();
+    if (sort_rays && !options["wavefront"].as<bool>()) {
+        LUISA_ERROR("--sort-rays reorders the wavefront queues, pass --wavefront as well.");
+    }
+    if (options["wavefront"].as<bool>()) {
+        if (tiled) {
+            LUISA_ERROR("--tile-size is only supported by the megakernel.");
+        }
+        if (collect_stats) {
+            LUISA_WARNING("--stats only instruments the megakernel.");
+            collect_stats = false;
+        }
+        if (adaptive) {
+            LUISA_WARNING("Adaptive sampling only applies to the megakernel.");
+            adaptive = false;
+        }
+        wavefront = luisa::make_unique<wavefront_renderer>(
+            device, stream, scene, mats, lights, cam, samplers, accum, background, max_depth, rr_depth, resolution, sort_rays);
+    } else {
+        render = device.compile(render_kernel, accum.shader_option());
+    }
 
-    Clock clk;
-    for (std::size_t sample_index = 0; sample_index < samples_per_pixel; ++sample_index) {
-        stream << render(seed_image, accum_image, sample_index).dispatch(resolution)
-            << [sample_index, samples_per_pixel, &clk] () {
-                LUISA_INFO(
-                    "Samples: {} / {} ({:.1f}s)",
-                    sample_index + 1u,
-                    samples_per_pixel,
-                    clk.toc() * 1e-3
-                );
-            };
+    // Samples per dispatch, fixed or, with --spp-per-dispatch 0, doubled from
+    // one until a dispatch takes about --dispatch-ms and then scaled to it.
+    // Progress is reported every --progress-interval dispatches.
+    uint spp_per_dispatch = options["spp-per-dispatch"].as<uint>();
+    bool calibrating = spp_per_dispatch == 0u;
+    auto target_dispatch_ms = options["dispatch-ms"].as<double>();
+    auto progress_interval = std::max(options["progress-interval"].as<uint>(), 1u);
+    if (calibrating) {
+        spp_per_dispatch = 1u;
     }
 
-    // Gamma Correct
-    Kernel2D gamma_kernel = [&](ImageFloat accum_image, ImageFloat output) {
+    // Gamma Correct, of pixels with sample_count samples each unless the
+    // adaptive sampler kept their count in moment_image.
+    Kernel2D gamma_kernel = [&](ImageFloat output, UInt sample_count) {
         UInt2 coord = dispatch_id().xy();
+        Float pixel_samples = cast<Float>(sample_count);
+        if (adaptive) {
+            pixel_samples = moment_image->read(coord).z;
+        }
         output.write(
             coord,
-            make_float4(sqrt(accum_image.read(coord).xyz()), 1.0f)
+            make_float4(sqrt(accum.resolve(coord, pixel_samples)), 1.0f)
         );
     };
 
     auto gamma_correct = device.compile(gamma_kernel);
-    auto output_image = device.create_image<float>(PixelStorage::BYTE4, resolution);
-
-    stream << gamma_correct(accum_image, output_image).dispatch(resolution);
-    stream << output_image.copy_to(host_image.data()) << synchronize();
-    stbi_write_png(
-        (options["outfile"].as<luisa::string>() + ".png").c_str(),
-        static_cast<int>(resolution.x),
-        static_cast<int>(resolution.y),
-        4,
-        host_image.data(),
-        0
+    auto output_image = device.create_image<float>(PixelStorage::BYTE4, tile_resolution);
+
+    // Tiled renders go to a PPM file, whose rows each tile can seek into.
+    std::ofstream ppm_file;
+    if (tiled) {
+        auto ppm_name = options["outfile"].as<luisa::string>() + ".ppm";
+        ppm_file.open(ppm_name.c_str(), std::ios::binary);
+        if (!ppm_file) {
+            LUISA_ERROR("Failed to open '{}' for writing.", ppm_name);
+        }
+        ppm_file << "P6\n" << resolution.x << " " << resolution.y << "\n255\n";
+    }
+
+    // With --rmse-reference, the error against a converged render is logged
+    // whenever the sample count passes a power of two, to compare samplers.
+    luisa::vector<std::byte> rmse_reference;
+    if (auto reference_name = options["rmse-reference"].as<luisa::string>(); !reference_name.empty()) {
+        if (tiled) {
+            LUISA_ERROR("--rmse-reference needs the whole image and is not supported with --tile-size.");
+        }
+        rmse_reference = load_rmse_reference(reference_name, resolution);
+    }
+
+    auto write_png = [&](std::size_t sample_count) {
+        stream << gamma_correct(output_image, static_cast<uint>(sample_count)).dispatch(resolution);
+        stream << output_image.copy_to(host_image.data()) << synchronize();
+        stbi_write_png(
+            (options["outfile"].as<luisa::string>() + ".png").c_str(),
+            static_cast<int>(resolution.x),
+            static_cast<int>(resolution.y),
+            4,
+            host_image.data(),
+            0
+        );
+    };
+    if (tiled && checkpoint_interval > 0.0) {
+        LUISA_WARNING("--checkpoint-interval is ignored with --tile-size, tiles are written as they finish.");
+        checkpoint_interval = 0.0;
+    }
+
+    Clock clk;
+    double next_checkpoint = checkpoint_interval;
+    std::size_t samples_rendered { 0u };
+    std::size_t uniform_samples { 0u };
+    std::size_t total_rays { 0u };
+    std::size_t accumulation_bytes { 0u };
+    std::size_t samples_taken { 0u };
+    double mean_error { 0.0 };
+    double error_sum_over_tiles { 0.0 };
+    auto pixel_count = static_cast<std::size_t>(resolution.x) * resolution.y;
+
+    // Tiles are rendered one after the other with all their samples.
+    uint2 tile_grid = (resolution + tile_resolution - 1u) / tile_resolution;
+    uint tile_count = tile_grid.x * tile_grid.y;
+    for (uint tile_index = 0u; tile_index < tile_count; tile_index++) {
+        uint2 tile_offset = make_uint2(tile_index % tile_grid.x, tile_index / tile_grid.x) * tile_resolution;
+        uint2 tile_extent = luisa::min(tile_resolution, resolution - tile_offset);
+        auto tile_pixels = static_cast<std::size_t>(tile_extent.x) * tile_extent.y;
+        std::size_t dispatch_count { 0u };
+        std::size_t sample_index { 0u };
+        while (sample_index < samples_per_pixel) {
+            auto sample_count = static_cast<uint>(std::min<std::size_t>(spp_per_dispatch, samples_per_pixel - sample_index));
+            Clock dispatch_clk;
+            // Every pass over the pixels reads and writes their accumulation
+            // once; the wavefront renderer makes one pass per sample.
+            accumulation_bytes += 2u * accum.bytes_per_pixel() * tile_pixels * (wavefront != nullptr ? sample_count : 1u);
+            if (wavefront != nullptr) {
+                for (uint s = 0u; s < sample_count; s++) {
+                    total_rays += wavefront->render(static_cast<uint>(sample_index + s));
+                }
+            } else {
+                if (adaptive) {
+                    stream << adaptive_counter.copy_from(zero_adaptive_counter.data());
+                }
+                stream << render(
+                    stats_image,
+                    moment_image,
+                    tile_offset,
+                    resolution,
+                    sample_index,
+                    sample_count,
+                    max_depth,
+                    rr_depth,
+                    adaptive_threshold,
+                    min_samples
+                ).dispatch(tile_extent);
+            }
+            sample_index += sample_count;
+            dispatch_count++;
+
+            if (!rmse_reference.empty() && std::bit_floor(sample_index) > sample_index - sample_count) {
+                stream << gamma_correct(output_image, static_cast<uint>(sample_index)).dispatch(resolution)
+                    << output_image.copy_to(host_image.data())
+                    << synchronize();
+                LUISA_INFO("RMSE at {} samples per pixel: {:.6f}", sample_index, image_rmse(host_image, rmse_reference));
+            }
+
+            // Stops once every pixel has converged or, past --min-samples, once the
+            // mean relative error meets --noise-target.
+            if (adaptive) {
+                stream << adaptive_counter.copy_to(host_adaptive_counter.data()) << synchronize();
+                std::size_t active_pixels { 0u };
+                std::size_t error_sum { 0u };
+                for (uint i = 0u; i < ray_counter_count; i++) {
+                    active_pixels += host_adaptive_counter[i];
+                    error_sum += host_adaptive_counter[ray_counter_count + i];
+                }
+                samples_taken += active_pixels * sample_count;
+                mean_error = static_cast<double>(error_sum) / adaptive_error_scale / static_cast<double>(tile_pixels);
+                bool converged = active_pixels == 0u
+                    || (noise_target > 0.0f && sample_index >= min_samples && mean_error <= noise_target);
+                if (converged) {
+                    LUISA_INFO(
+                        "{}onverged after {} samples per pixel (mean relative error {:.4f}).",
+                        tiled ? "Tile c" : "C",
+                        sample_index,
+                        mean_error
+                    );
+                    break;
+                }
+            }
+
+            if (calibrating) {
+                stream << synchronize();
+                auto dispatch_ms = dispatch_clk.toc();
+                if (dispatch_ms < 0.5 * target_dispatch_ms) {
+                    spp_per_dispatch = sample_count * 2u;
+                } else {
+                    spp_per_dispatch = std::max(static_cast<uint>(sample_count * target_dispatch_ms / dispatch_ms), 1u);
+                    calibrating = false;
+                    LUISA_INFO("Rendering {} samples per dispatch ({:.1f}ms for {}).", spp_per_dispatch, dispatch_ms, sample_count);
+                }
+            }
+
+            if (dispatch_count % progress_interval == 0u || sample_index == samples_per_pixel) {
+                stream << [sample_index, samples_per_pixel, time_limit, &clk] () {
+                    if (time_limit > 0.0) {
+                        LUISA_INFO("Samples: {} ({:.1f}s of {:.1f}s)", sample_index, clk.toc() * 1e-3, time_limit);
+                    } else {
+                        LUISA_INFO(
+                            "Samples: {} / {} ({:.1f}s)",
+                            sample_index,
+                            samples_per_pixel,
+                            clk.toc() * 1e-3
+                        );
+                    }
+                };
+            }
+
+            // Each tile may run until its share of the budget is used up.
+            // Checked once per dispatch, so a dispatch can overrun it.
+            if (time_limit > 0.0 || checkpoint_interval > 0.0) {
+                stream << synchronize();
+                auto elapsed = clk.toc() * 1e-3;
+                if (time_limit > 0.0 && elapsed >= time_limit * (tile_index + 1u) / tile_count) {
+                    LUISA_INFO("Time limit reached after {} samples per pixel ({:.1f}s).", sample_index, elapsed);
+                    break;
+                }
+                if (checkpoint_interval > 0.0 && elapsed >= next_checkpoint) {
+                    write_png(sample_index);
+                    next_checkpoint = (std::floor(elapsed / checkpoint_interval) + 1.0) * checkpoint_interval;
+                    LUISA_INFO("Checkpoint with {} samples per pixel written ({:.1f}s).", sample_index, elapsed);
+                }
+            }
+        }
+        samples_rendered = std::max(samples_rendered, sample_index);
+        uniform_samples += tile_pixels * (time_limit > 0.0 ? sample_index : samples_per_pixel);
+        error_sum_over_tiles += mean_error * static_cast<double>(tile_pixels);
+
+        if (tiled) {
+            stream << gamma_correct(output_image, static_cast<uint>(sample_index)).dispatch(tile_extent)
+                << output_image.copy_to(host_image.data())
+                << synchronize();
+            write_ppm_tile(ppm_file, resolution, tile_offset, tile_extent, tile_resolution.x, host_image);
+            LUISA_INFO("Tile {} / {} written ({:.1f}s).", tile_index + 1u, tile_count, clk.toc() * 1e-3);
+        }
+    }
+    stream << ray_counter.copy_to(host_ray_counter.data()) << synchronize();
+
+    auto render_time = clk.toc() * 1e-3;
+    for (auto count : host_ray_counter) {
+        total_rays += count;
+    }
+    LUISA_INFO(
+        "{}: traced {} rays in {:.2f}s ({:.2f} Mrays/s).",
+        wavefront == nullptr ? "Megakernel" : sort_rays ? "Wavefront (sorted)" : "Wavefront",
+        total_rays,
+        render_time,
+        static_cast<double>(total_rays) * 1e-6 / render_time
+    );
+    LUISA_INFO(
+        "Accumulation traffic: {:.2f} GB ({:.2f} GB/s).",
+        static_cast<double>(accumulation_bytes) * 1e-9,
+        static_cast<double>(accumulation_bytes) * 1e-9 / render_time
     );
+    if (adaptive) {
+        LUISA_INFO(
+            "Adaptive sampling: {} samples instead of {} ({:.1f}% saved), mean relative error {:.4f}.",
+            samples_taken,
+            uniform_samples,
+            100.0 * (1.0 - static_cast<double>(samples_taken) / static_cast<double>(uniform_samples)),
+            error_sum_over_tiles / static_cast<double>(pixel_count)
+        );
+    }
+    if (collect_stats) {
+        report_trace_stats(
+            stream,
+            stats_image,
+            adaptive ? &moment_image : nullptr,
+            resolution,
+            samples_rendered,
+            render_time,
+            options["outfile"].as<luisa::string>()
+        );
+    }
+
+    if (!tiled) {
+        write_png(samples_rendered);
+    }
 
     return 0;
 }
@@ -256,7 +771,7 @@ int main(int argc, char *argv[]) {
 
 namespace {
 
-hittable_list random_scene() {
+hittable_list random_scene(Device &d, Stream &s) {
     hittable_list world;
 
     auto checker = make_shared<checker_texture>(
@@ -317,7 +832,7 @@ hittable_list random_scene() {
     auto material3 = make_shared<metal>(float3(0.7, 0.6, 0.5), 0.0);
     world.add(make_shared<sphere>(float3(4, 1, 0), 1.0, material3));
 
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = hittable_list(make_shared<linear_bvh>(d, s, world));
 
     return world;
 }
@@ -395,13 +910,13 @@ hittable_list cornell_box() {
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
 
     shared_ptr<hittable> box1 = make_shared<box>(float3(0, 0, 0), float3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, float3(265, 0, 295));
+    box1 = make_shared<instance>(
+        box1, luisa::translation(float3(265, 0, 295)) * luisa::rotation(float3(0, 1, 0), luisa::radians(15.0f)));
     objects.add(box1);
 
     shared_ptr<hittable> box2 = make_shared<box>(float3(0, 0, 0), float3(165, 165, 165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, float3(130, 0, 65));
+    box2 = make_shared<instance>(
+        box2, luisa::translation(float3(130, 0, 65)) * luisa::rotation(float3(0, 1, 0), luisa::radians(-18.0f)));
     objects.add(box2);
 
     return objects;
@@ -423,12 +938,12 @@ hittable_list cornell_smoke() {
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
 
     shared_ptr<hittable> box1 = make_shared<box>(float3(0, 0, 0), float3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, float3(265, 0, 295));
+    box1 = make_shared<instance>(
+        box1, luisa::translation(float3(265, 0, 295)) * luisa::rotation(float3(0, 1, 0), luisa::radians(15.0f)));
 
     shared_ptr<hittable> box2 = make_shared<box>(float3(0, 0, 0), float3(165, 165, 165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, float3(130, 0, 65));
+    box2 = make_shared<instance>(
+        box2, luisa::translation(float3(130, 0, 65)) * luisa::rotation(float3(0, 1, 0), luisa::radians(-18.0f)));
 
     objects.add(make_shared<constant_medium>(box1, 0.01, float3(0, 0, 0)));
     objects.add(make_shared<constant_medium>(box2, 0.01, float3(1, 1, 1)));
@@ -463,7 +978,7 @@ hittable_list final_scene(Device &d, Stream &s) {
 
     hittable_list objects;
 
-    objects.add(make_shared<bvh_node>(boxes1));
+    objects.add(make_shared<linear_bvh>(d, s, boxes1));
 
     auto light = make_shared<diffuse_light>(float3(7, 7, 7));
     objects.add(make_shared<xz_rect>(123, 423, 147, 412, 554, light));
@@ -496,10 +1011,9 @@ hittable_list final_scene(Device &d, Stream &s) {
         boxes2.add(make_shared<sphere>(float3(random_float(0, 165)), 10, white));
     }
 
-    objects.add(make_shared<translate>(
-        make_shared<rotate_y>(
-            make_shared<bvh_node>(boxes2), 15),
-        float3(-100, 270, 395)));
+    objects.add(make_shared<instance>(
+        make_shared<linear_bvh>(d, s, boxes2),
+        luisa::translation(float3(-100, 270, 395)) * luisa::rotation(float3(0, 1, 0), luisa::radians(15.0f))));
 
     return objects;
 }
@@ -508,28 +1022,32 @@ Float3 ray_color(
     const ray &r_,
     const Float3 background,
     const hittable &world,
+    const material_table &mats,
+    const light_list &lights,
     UInt max_depth,
-    UInt &seed
+    UInt rr_depth,
+    const first_vertex_samples &first_samples,
+    const UInt &key,
+    UInt &ray_count
 ) {
-    Float3 ret {};
-
-    ArrayFloat3<MAX_DEPTH + 1> emittedRec;
-    ArrayFloat3<MAX_DEPTH + 1> attenuationRec;
+    // Radiance is gathered forwards, weighting each emission by the product of
+    // the attenuations along the path so far.
+    Float3 radiance = make_float3(0.0f);
+    Float3 throughput = make_float3(1.0f);
+    Float bsdf_pdf = 0.0f;// density r was sampled with, 0 from the camera and specular bounces
     ray r = r_;
-    UInt depth = max_depth;
     hit_record rec;
-    $loop {
-        // If we've exceeded the ray bounce limit, no more light is gathered.
-        $if (depth <= 0) {
-            emittedRec[depth] = make_float3(0);
-            attenuationRec[depth] = make_float3(0);
-            $break;
-        };
+    UInt seed;
+
+    // If we've exceeded the ray bounce limit, no more light is gathered.
+    $for (depth, 0u, max_depth) {
+        seed = bounce_seed(key, depth + 1u);
 
         // If the ray hits nothing, return the background color.
+        ray_count += 1u;
+        count_trace(&trace_counters::bounces);
         $if (!world.hit(r, 0.001f, infinity, rec, seed)) {
-            emittedRec[depth] = make_float3(0);
-            attenuationRec[depth] = background;
+            radiance += throughput * background;
             $break;
         };
 
@@ -537,37 +1055,596 @@ Float3 ray_color(
         Float3 attenuation;
         Float3 emitted;
         Bool hasScatter;
-
-        for (uint mat_id = 0; mat_id < materials.size(); mat_id++) {
-            $if (rec.mat_id == mat_id) {
-                emitted = materials[mat_id]->emitted(rec.u, rec.v, rec.p);
-                hasScatter = materials[mat_id]->scatter(r, rec, attenuation, scattered, seed);
+        Float pdf;
+
+        // Only the first vertex draws from the sampler, later ones from the LCG.
+        Float3 scatter_sample = ite(depth == 0u, first_samples.scatter, random_float3(seed));
+        mats.evaluate(rec.mat_id, r, rec, emitted, attenuation, scattered, hasScatter, pdf, scatter_sample);
+        if (!lights.empty()) {
+            emitted *= lights.emission_weight(r, rec, bsdf_pdf);
+            // At the last vertex no BSDF sample follows to count the light's
+            // share of the MIS weight, so neither strategy counts it.
+            $if (mats.is_diffuse(rec.mat_id) & (depth + 1u < max_depth)) {
+                Float3 light_sample = ite(depth == 0u, first_samples.light, random_float3(seed));
+                radiance += throughput * lights.sample_direct(world, mats, r, rec, light_sample, seed);
             };
         }
+        if (has_feature(scene_feature::emissive)) {
+            radiance += throughput * emitted;
+        }
 
         $if (!hasScatter) {
-            emittedRec[depth] = emitted;
-            attenuationRec[depth] = make_float3(0);
             $break;
         };
 
-        emittedRec[depth] = emitted;
-        attenuationRec[depth] = attenuation;
+        throughput *= attenuation;
         r = scattered;
-        depth -= 1u;
+        bsdf_pdf = pdf;
+        $if (!russian_roulette(throughput, depth + 1u, rr_depth, seed)) {
+            $break;
+        };
     };
 
-    ret = make_float3(1.0f);
-    $loop {
-        ret = emittedRec[depth] + attenuationRec[depth] * ret;
-        depth += 1u;
+    return radiance;
+};
 
-        $if (depth > max_depth) {
-            $break;
+// The scene_feature bits of world, mats and cam.
+uint detect_scene_features(const hittable_list &world, const material_table &mats, const camera &cam) {
+    uint features = world.features();
+    if (cam.has_depth_of_field()) {
+        features |= static_cast<uint>(scene_feature::depth_of_field);
+    }
+    if (mats.uses(material_type::diffuse_light)) {
+        features |= static_cast<uint>(scene_feature::emissive);
+    }
+    if (mats.texture_count() > 0u) {
+        features |= static_cast<uint>(scene_feature::textures);
+    }
+    return features;
+}
+
+void check_scene_features(Device &device, Stream &stream) {
+    auto motion_blur = static_cast<uint>(scene_feature::motion_blur);
+    auto volumes = static_cast<uint>(scene_feature::volumes);
+
+    // A moving sphere under every kind of wrapper, and one bounding a medium.
+    auto mat = make_shared<lambertian>(float3(0.5f, 0.5f, 0.5f));
+    hittable_list moving;
+    moving.add(make_shared<moving_sphere>(float3(0, 0, 0), float3(0, 1, 0), 0.0f, 1.0f, 1.0f, mat));
+    moving.add(make_shared<sphere>(float3(3, 0, 0), 1.0f, mat));
+    hittable_list wrapped;
+    wrapped.add(make_shared<translate>(make_shared<rotate_y>(make_shared<bvh_node>(moving), 15.0f), float3(1, 0, 0)));
+    hittable_list moving_medium;
+    moving_medium.add(make_shared<constant_medium>(
+        make_shared<moving_sphere>(float3(0, 0, 0), float3(0, 1, 0), 0.0f, 1.0f, 1.0f, mat), 0.01f, float3(1, 1, 1)));
+
+    std::array<std::pair<const char *, uint>, 6> expected {{
+        { "random_scene", motion_blur },
+        { "two_spheres", 0u },
+        { "cornell_smoke", volumes },
+        { "final_scene", motion_blur | volumes },
+        { "a moving sphere under translate, rotate_y and bvh_node", motion_blur },
+        { "a medium bounded by a moving sphere", motion_blur | volumes }
+    }};
+    std::array<uint, 6> detected {
+        random_scene(device, stream).features(),
+        two_spheres().features(),
+        cornell_smoke().features(),
+        final_scene(device, stream).features(),
+        wrapped.features(),
+        moving_medium.features()
+    };
+    for (std::size_t i = 0u; i < expected.size(); i++) {
+        if (detected[i] != expected[i].second) {
+            LUISA_ERROR(
+                "{} reports the features '{}' instead of '{}'.",
+                expected[i].first,
+                describe_features(detected[i]),
+                describe_features(expected[i].second)
+            );
+        }
+    }
+    LUISA_INFO("Scene features of {} scenes match.", expected.size());
+}
+
+void check_accumulation(Device &device, Stream &stream) {
+    // 2^20 samples around 0.15: once the sum passes 2^17 its spacing is
+    // 2^-6, so a plain float sum rounds away most of each sample's low bits.
+    static constexpr uint sample_count { 1u << 20u };
+    auto sample = [](uint i) {
+        return 0.1f + 0.01f * static_cast<float>(i % 10u);
+    };
+    double exact { 0.0 };
+    for (uint i = 0u; i < sample_count; i++) {
+        exact += static_cast<double>(sample(i));
+    }
+    exact /= static_cast<double>(sample_count);
+
+    Buffer<float4> means = device.create_buffer<float4>(1u);
+    auto accumulate = [&](accumulation_format format) {
+        accumulator accum(device, make_uint2(1u), format);
+        Kernel1D add_kernel = [&] {
+            accumulation acc = accum.load(make_uint2(0u), 0u);
+            $for (i, 0u, sample_count) {
+                accum.add(acc, make_float3(0.1f + 0.01f * cast<Float>(i % 10u)));
+            };
+            accum.store(make_uint2(0u), acc);
         };
+        Kernel1D resolve_kernel = [&] {
+            means->write(0u, make_float4(accum.resolve(make_uint2(0u), def(static_cast<float>(sample_count))), 1.0f));
+        };
+        auto add = device.compile(add_kernel, accum.shader_option());
+        auto resolve = device.compile(resolve_kernel);
+        float4 mean {};
+        stream << add().dispatch(1u)
+            << resolve().dispatch(1u)
+            << means.copy_to(&mean)
+            << synchronize();
+        return static_cast<double>(mean.x);
     };
+
+    auto plain = accumulate(accumulation_format::sum);
+    LUISA_INFO("Mean of {} samples: {:.7f} exact, {:.7f} summed ({:.2e} off).", sample_count, exact, plain, std::abs(plain - exact));
+    static constexpr std::array<std::pair<accumulation_format, const char *>, 2> compensated_formats {{
+        { accumulation_format::kahan, "Kahan" },
+        { accumulation_format::double_float, "Double-float" }
+    }};
+    for (auto [format, name] : compensated_formats) {
+        auto compensated = accumulate(format);
+        LUISA_INFO("{} mean: {:.7f} ({:.2e} off).", name, compensated, std::abs(compensated - exact));
+        if (compensated == plain) {
+            LUISA_ERROR("{} accumulation gives the same mean as the plain sum, its compensation was lost.", name);
+        }
+        if (std::abs(compensated - exact) > 1e-6 * exact) {
+            LUISA_ERROR("{} accumulation is off by {:.2e}.", name, std::abs(compensated - exact));
+        }
+    }
+}
+
+// Writes the RGBA8 tile_image, of rows tile_width pixels wide, into its rows
+// of a binary PPM of the given resolution whose header is already written.
+void write_ppm_tile(
+    std::ofstream &file,
+    uint2 resolution,
+    uint2 tile_offset,
+    uint2 tile_extent,
+    uint tile_width,
+    const luisa::vector<std::byte> &tile_image
+) {
+    auto header_size = 3u + std::to_string(resolution.x).size() + 1u + std::to_string(resolution.y).size() + 5u;
+
+    luisa::vector<char> row(tile_extent.x * 3u);
+    for (uint y = 0u; y < tile_extent.y; y++) {
+        for (uint x = 0u; x < tile_extent.x; x++) {
+            for (uint c = 0u; c < 3u; c++) {
+                row[x * 3u + c] = static_cast<char>(tile_image[(y * tile_width + x) * 4u + c]);
+            }
+        }
+        auto offset = (static_cast<std::size_t>(tile_offset.y + y) * resolution.x + tile_offset.x) * 3u;
+        file.seekp(static_cast<std::streamoff>(header_size + offset));
+        file.write(row.data(), static_cast<std::streamsize>(row.size()));
+    }
+}
+
+luisa::vector<std::byte> load_rmse_reference(const luisa::string &filename, uint2 resolution) {
+    int width;
+    int height;
+    int channels;
+    auto data = stbi_load(filename.c_str(), &width, &height, &channels, 4);
+    if (data == nullptr) {
+        LUISA_ERROR("Failed to load RMSE reference '{}'.", filename);
+    }
+    if (static_cast<uint>(width) != resolution.x || static_cast<uint>(height) != resolution.y) {
+        LUISA_ERROR(
+            "RMSE reference '{}' is {}x{}, the render is {}x{}.",
+            filename, width, height, resolution.x, resolution.y
+        );
+    }
+    auto bytes = reinterpret_cast<const std::byte *>(data);
+    luisa::vector<std::byte> reference(bytes, bytes + static_cast<std::size_t>(width) * height * 4u);
+    stbi_image_free(data);
+    return reference;
+}
+
+double image_rmse(const luisa::vector<std::byte> &image, const luisa::vector<std::byte> &reference) {
+    double sum { 0.0 };
+    for (std::size_t i = 0u; i < image.size(); i++) {
+        if (i % 4u != 3u) {
+            auto d = (static_cast<double>(image[i]) - static_cast<double>(reference[i])) / 255.0;
+            sum += d * d;
+        }
+    }
+    return std::sqrt(sum / static_cast<double>(image.size() / 4u * 3u));
+}
+
+void report_trace_stats(
+    Stream &stream,
+    Image<uint> &stats_image,
+    Image<float> *moment_image,
+    uint2 resolution,
+    std::size_t samples_per_pixel,
+    double render_time,
+    const luisa::string &outfile
+) {
+    static constexpr std::array<const char *, 4> names { "nodes", "slab_tests", "primitive_tests", "bounces" };
+
+    // Black through purple, red and yellow to white.
+    static constexpr std::array<std::array<float, 3>, 5> heat {{
+        { 0.0f, 0.0f, 0.0f },
+        { 0.5f, 0.0f, 0.6f },
+        { 0.9f, 0.1f, 0.1f },
+        { 1.0f, 0.9f, 0.0f },
+        { 1.0f, 1.0f, 1.0f }
+    }};
+
+    std::size_t pixel_count = resolution.x * resolution.y;
+    luisa::vector<uint4> stats(pixel_count);
+    stream << stats_image.copy_to(stats.data()) << synchronize();
+
+    luisa::vector<float> pixel_samples(pixel_count, static_cast<float>(samples_per_pixel));
+    if (moment_image != nullptr) {
+        luisa::vector<float4> moments(pixel_count);
+        stream << moment_image->copy_to(moments.data()) << synchronize();
+        for (std::size_t i = 0; i < pixel_count; i++) {
+            pixel_samples[i] = std::max(moments[i].z, 1.0f);
+        }
+    }
+
+    for (std::size_t c = 0; c < names.size(); c++) {
+        luisa::vector<float> values(pixel_count);
+        double sum { 0.0 };
+        double total { 0.0 };
+        for (std::size_t i = 0; i < pixel_count; i++) {
+            values[i] = static_cast<float>(stats[i][c]) / pixel_samples[i];
+            sum += values[i];
+            total += static_cast<double>(stats[i][c]);
+        }
+
+        auto sorted = values;
+        std::sort(sorted.begin(), sorted.end());
+        auto p99 = sorted[std::min(pixel_count - 1u, pixel_count * 99u / 100u)];
+        LUISA_INFO(
+            "{} per path: mean {:.2f}, p99 {:.2f}, max {:.2f}.",
+            names[c],
+            sum / static_cast<double>(pixel_count),
+            p99,
+            sorted.back()
+        );
+        if (c == 1u) {
+            // Node tests per second over the whole render, counters included.
+            LUISA_INFO(
+                "slab_tests per second: {:.1f}M.",
+                total * 1e-6 / render_time
+            );
+        }
+
+        // Scaled to the p99, so that a few outliers do not flatten the rest.
+        luisa::vector<std::array<std::uint8_t, 4>> pixels(pixel_count);
+        for (std::size_t i = 0; i < pixel_count; i++) {
+            auto x = std::clamp(values[i] / std::max(p99, 1e-6f), 0.0f, 1.0f) * static_cast<float>(heat.size() - 1u);
+            auto stop = std::min(static_cast<std::size_t>(x), heat.size() - 2u);
+            auto f = x - static_cast<float>(stop);
+            for (std::size_t k = 0; k < 3; k++) {
+                auto v = heat[stop][k] + f * (heat[stop + 1u][k] - heat[stop][k]);
+                pixels[i][k] = static_cast<std::uint8_t>(v * 255.0f + 0.5f);
+            }
+            pixels[i][3] = 255u;
+        }
+        stbi_write_png(
+            (outfile + "_" + names[c] + ".png").c_str(),
+            static_cast<int>(resolution.x),
+            static_cast<int>(resolution.y),
+            4,
+            pixels.data(),
+            0
+        );
+    }
+}
+
+random_spheres make_random_spheres(std::size_t count) {
+    random_spheres ret;
+    ret.extent = 4.0f * std::cbrt(static_cast<float>(count));
+    ret.centers.reserve(count);
+    ret.radii.reserve(count);
+    for (std::size_t i = 0u; i < count; i++) {
+        ret.centers.emplace_back(random_float(0.0f, ret.extent), random_float(0.0f, ret.extent), random_float(0.0f, ret.extent));
+        ret.radii.push_back(random_float(0.5f, 1.5f));
+    }
     return ret;
-};
+}
+
+Shader1D<uint> compile_random_trace(
+    Device &device,
+    const hittable &world,
+    const aabb &box,
+    Buffer<uint> &counts,
+    uint counter,
+    bool counted
+) {
+    Kernel1D kernel = [&](UInt frame) {
+        trace_counters counters;
+        if (counted) {
+            trace_stats = &counters;
+        }
+        UInt seed = sample_key(make_uint2(dispatch_x(), frame), 0u);
+        Float3 origin = box.min() + random_float3(seed) * (box.max() - box.min());
+        ray r(origin, random_unit_vector(seed));
+        hit_record rec;
+        $if (world.hit(r, 0.001f, infinity, rec, seed)) {
+            counts->atomic(counter).fetch_add(1u);
+        };
+        trace_stats = nullptr;
+        if (counted) {
+            counts->atomic(counter + 1u).fetch_add(counters.slab_tests);
+        }
+    };
+    return device.compile(kernel);
+}
+
+void bench_bvh_build() {
+    task_pool single_thread { 1u };
+    auto &all_threads = bvh_task_pool();
+
+    for (std::size_t count = 1000u; count <= 10'000'000u; count *= 10u) {
+        auto spheres = make_random_spheres(count);
+        luisa::vector<aabb> boxes;
+        boxes.reserve(count);
+        for (std::size_t i = 0u; i < count; i++) {
+            boxes.emplace_back(spheres.centers[i] - spheres.radii[i], spheres.centers[i] + spheres.radii[i]);
+        }
+
+        auto build_time = [&](task_pool &pool, std::size_t &node_count) {
+            luisa::vector<linear_bvh_node> nodes;
+            luisa::vector<uint> order;
+            Clock clk;
+            sah_builder(pool).build(boxes, nodes, order);
+            node_count = nodes.size();
+            return clk.toc();
+        };
+
+        std::size_t node_count {};
+        auto single_time = build_time(single_thread, node_count);
+        auto parallel_time = build_time(all_threads, node_count);
+        LUISA_INFO(
+            "BVH build over {} spheres: {} nodes, {:.2f} ms on 1 thread, {:.2f} ms on {} threads ({:.2f}x).",
+            count,
+            node_count,
+            single_time,
+            parallel_time,
+            all_threads.size(),
+            single_time / parallel_time
+        );
+    }
+}
+
+void bench_refit(Device &device, Stream &stream) {
+    static constexpr uint sphere_count = 100'000u;
+    static constexpr uint frame_count = 30u;
+    static constexpr uint ray_count = 1u << 20u;
+
+    // Spheres in a cube, each drifting along its own velocity, so refitted
+    // boxes overlap more every frame.
+    auto cube = make_random_spheres(sphere_count);
+    auto mat = make_shared<lambertian>(float3(0.5f, 0.5f, 0.5f));
+    hittable_list spheres;
+    luisa::vector<float3> velocities;
+    for (uint i = 0u; i < sphere_count; i++) {
+        spheres.add(make_shared<sphere>(cube.centers[i], cube.radii[i], mat));
+        velocities.emplace_back(random_float(-1.0f, 1.0f), random_float(-1.0f, 1.0f), random_float(-1.0f, 1.0f));
+    }
+    aabb ray_box(make_float3(0.0f), make_float3(cube.extent));
+
+    // Both trees pack the spheres in list order, so table entry i is sphere i.
+    linear_bvh refitted(device, stream, spheres, bvh_build_method::sah);
+    linear_bvh rebuilt(device, stream, spheres, bvh_build_method::sah);
+
+    // Kernels are compiled once, before the first frame, so every frame also
+    // checks that refits and rebuilds keep the buffers they captured.
+    Buffer<uint> hit_counts = device.create_buffer<uint>(2u);
+    auto trace_refitted = compile_random_trace(device, refitted, ray_box, hit_counts, 0u, false);
+    auto trace_rebuilt = compile_random_trace(device, rebuilt, ray_box, hit_counts, 1u, false);
+
+    std::array<uint, 2> zero_counts {};
+    std::array<uint, 2> counts {};
+    double refit_ms { 0.0 };
+    double rebuild_ms { 0.0 };
+    double refitted_trace_ms { 0.0 };
+    double rebuilt_trace_ms { 0.0 };
+    uint fallback_rebuilds { 0u };
+    for (uint frame = 0u; frame < frame_count; frame++) {
+        for (uint i = 0u; i < sphere_count; i++) {
+            refitted.table.spheres[i].center += velocities[i];
+            rebuilt.table.spheres[i].center += velocities[i];
+        }
+
+        Clock clk;
+        fallback_rebuilds += refitted.refit(device, stream) ? 1u : 0u;
+        auto frame_refit_ms = clk.toc();
+        clk.tic();
+        rebuilt.rebuild(device, stream);
+        auto frame_rebuild_ms = clk.toc();
+
+        stream << hit_counts.copy_from(zero_counts.data());
+        clk.tic();
+        stream << trace_refitted(frame).dispatch(ray_count) << synchronize();
+        auto frame_refitted_trace_ms = clk.toc();
+        clk.tic();
+        stream << trace_rebuilt(frame).dispatch(ray_count) << synchronize();
+        auto frame_rebuilt_trace_ms = clk.toc();
+        stream << hit_counts.copy_to(counts.data()) << synchronize();
+        if (counts[0] != counts[1]) {
+            LUISA_ERROR("Frame {}: {} rays hit the refitted BVH and {} the rebuilt one.", frame, counts[0], counts[1]);
+        }
+
+        LUISA_INFO(
+            "Frame {}: refit {:.2f} ms (SAH cost {:.2f}, trace {:.2f} ms), rebuild {:.2f} ms (SAH cost {:.2f}, trace {:.2f} ms).",
+            frame,
+            frame_refit_ms,
+            refitted.sah_cost(),
+            frame_refitted_trace_ms,
+            frame_rebuild_ms,
+            rebuilt.sah_cost(),
+            frame_rebuilt_trace_ms
+        );
+        refit_ms += frame_refit_ms;
+        rebuild_ms += frame_rebuild_ms;
+        refitted_trace_ms += frame_refitted_trace_ms;
+        rebuilt_trace_ms += frame_rebuilt_trace_ms;
+    }
+    LUISA_INFO(
+        "{} frames of {} spheres: refit {:.2f} ms + trace {:.2f} ms per frame ({} fallback rebuilds), "
+        "rebuild {:.2f} ms + trace {:.2f} ms per frame.",
+        frame_count,
+        sphere_count,
+        refit_ms / frame_count,
+        refitted_trace_ms / frame_count,
+        fallback_rebuilds,
+        rebuild_ms / frame_count,
+        rebuilt_trace_ms / frame_count
+    );
+}
+
+void bench_traversal(Device &device, Stream &stream) {
+    static constexpr uint ray_count = 1u << 20u;
+    static constexpr uint repeat_count = 10u;
+    static constexpr std::array<std::pair<slab_test_method, const char *>, 3> methods {{
+        { slab_test_method::per_axis, "per-axis test with divisions" },
+        { slab_test_method::division, "select test with divisions" },
+        { slab_test_method::precomputed, "select test with reciprocals" }
+    }};
+
+    // Rays start in the cube the camera of final_scene frames, where most of
+    // its objects are; the mist around it would leave a ray from anywhere in
+    // its bounding box mostly in empty space.
+    aabb ray_box(make_float3(0.0f), make_float3(600.0f));
+
+    // The timed kernels are recorded without counters; a separate counted
+    // kernel gives the slab tests the timed ones do for the same rays.
+    Buffer<uint> counts = device.create_buffer<uint>(2u);
+
+    auto saved_width = default_bvh_width;
+    auto saved_method = default_bvh_build_method;
+    default_bvh_build_method = bvh_build_method::sah;
+    for (uint width : { 2u, 4u, 8u }) {
+        default_bvh_width = width;
+        auto world = final_scene(device, stream);
+        world.build(device, stream);
+
+        std::array<double, methods.size()> trace_ms {};
+        std::array<uint, methods.size()> hits {};
+        std::array<uint, methods.size()> slab_tests {};
+        for (std::size_t m = 0u; m < methods.size(); m++) {
+            default_slab_test_method = methods[m].first;
+            auto trace = compile_random_trace(device, world, ray_box, counts, 0u, false);
+            auto trace_counted = compile_random_trace(device, world, ray_box, counts, 0u, true);
+
+            std::array<uint, 2> host_counts {};
+            stream << counts.copy_from(host_counts.data())
+                << trace_counted(0u).dispatch(ray_count)
+                << counts.copy_to(host_counts.data())
+                << synchronize();
+            slab_tests[m] = host_counts[1];
+
+            host_counts = {};
+            stream << counts.copy_from(host_counts.data()) << trace(0u).dispatch(ray_count) << synchronize();
+            Clock clk;
+            for (uint i = 0u; i < repeat_count; i++) {
+                stream << trace(0u).dispatch(ray_count);
+            }
+            stream << synchronize();
+            trace_ms[m] = clk.toc() / repeat_count;
+            stream << counts.copy_to(host_counts.data()) << synchronize();
+            hits[m] = host_counts[0] / (repeat_count + 1u);
+        }
+        default_slab_test_method = slab_test_method::precomputed;
+
+        for (std::size_t m = 0u; m < methods.size(); m++) {
+            if (hits[m] != hits.back()) {
+                LUISA_WARNING("BVH{}: {} rays hit with the {}, {} with the {}.",
+                    width, hits[m], methods[m].second, hits.back(), methods.back().second);
+            }
+            LUISA_INFO(
+                "final_scene BVH{} {}: {:.2f} ms, {:.1f} Mrays/s, {:.1f} M slab tests/s ({:.2f}x the per-axis test).",
+                width,
+                methods[m].second,
+                trace_ms[m],
+                static_cast<double>(ray_count) / trace_ms[m] * 1e-3,
+                static_cast<double>(slab_tests[m]) / trace_ms[m] * 1e-3,
+                trace_ms.front() / trace_ms[m]
+            );
+        }
+    }
+    default_bvh_width = saved_width;
+    default_bvh_build_method = saved_method;
+}
+
+void bench_sampling(Device &device, Stream &stream) {
+    static constexpr uint thread_count = 1u << 20u;
+    static constexpr uint samples_per_thread = 256u;
+
+    // The rejection samplers the closed-form ones in rtweekend.h replaced.
+    auto rejection_in_unit_sphere = [](UInt &seed) {
+        Float3 p;
+        $loop {
+            p = random_float3(seed, -1.0f, 1.0f);
+            $if (length_squared(p) < 1.0f) { $break; };
+        };
+        return p;
+    };
+    auto rejection_in_unit_disk = [](UInt &seed) {
+        Float3 p;
+        $loop {
+            Float x = frand(seed, -1.0f, 1.0f);
+            Float y = frand(seed, -1.0f, 1.0f);
+            p = make_float3(x, y, 0.0f);
+            $if (length_squared(p) < 1.0f) { $break; };
+        };
+        return p;
+    };
+
+    // Each variant gets the unit normal of its thread, which only the
+    // hemisphere samplers use.
+    using sample_function = std::function<Float3(const Float3 &, UInt &)>;
+    std::array<std::pair<const char *, sample_function>, 8> variants {{
+        { "unit sphere, rejection", [&](const Float3 &, UInt &seed) { return rejection_in_unit_sphere(seed); } },
+        { "unit sphere, closed form", [](const Float3 &, UInt &seed) { return random_in_unit_sphere(seed); } },
+        { "unit vector, rejection", [&](const Float3 &, UInt &seed) { return normalize(rejection_in_unit_sphere(seed)); } },
+        { "unit vector, closed form", [](const Float3 &, UInt &seed) { return random_unit_vector(seed); } },
+        { "unit disk, rejection", [&](const Float3 &, UInt &seed) { return rejection_in_unit_disk(seed); } },
+        { "unit disk, closed form", [](const Float3 &, UInt &seed) { return random_in_unit_disk(seed); } },
+        { "cosine, normal + rejection", [&](const Float3 &n, UInt &seed) {
+            Float3 d = n + normalize(rejection_in_unit_sphere(seed));
+            return ite(near_zero(d), n, d);
+        } },
+        { "cosine, closed form", [](const Float3 &n, UInt &seed) { return random_cosine_direction(n, seed); } }
+    }};
+
+    Buffer<float> sums = device.create_buffer<float>(thread_count);
+    for (auto &[name, sample] : variants) {
+        Kernel1D kernel = [&]() {
+            UInt seed = sample_key(make_uint2(dispatch_x(), 0u), 0u);
+            Float3 n = random_unit_vector(seed);
+            Float3 sum = make_float3(0.0f);
+            $for (i, 0u, samples_per_thread) {
+                sum += sample(n, seed);
+            };
+            sums->write(dispatch_x(), sum.x + sum.y + sum.z);
+        };
+        auto shader = device.compile(kernel);
+
+        // The first dispatch warms up, the second is timed.
+        stream << shader().dispatch(thread_count) << synchronize();
+        Clock clk;
+        stream << shader().dispatch(thread_count) << synchronize();
+        auto time = clk.toc();
+        LUISA_INFO(
+            "{}: {:.1f} Msamples/s ({:.2f} ms).",
+            name,
+            static_cast<double>(thread_count) * samples_per_thread * 1e-3 / time,
+            time
+        );
+    }
+}
 
 cxxopts::ParseResult parse_cli_options(
     int argc,
@@ -597,6 +1674,33 @@ cxxopts::ParseResult parse_cli_options(
         cxxopts::value<int>()->default_value("1"),
         "<scene_id>"
     );
+    cli.add_option("", "", "accel", "Intersect through the backend acceleration structure", cxxopts::value<bool>()->default_value("false"), "");
+    cli.add_option("", "", "bvh", "BVH builder, median or sah", cxxopts::value<luisa::string>()->default_value("median"), "<builder>");
+    cli.add_option("", "", "sampler", "Sample generator, independent or sobol", cxxopts::value<luisa::string>()->default_value("sobol"), "<sampler>");
+    cli.add_option("", "", "rmse-reference", "Log the RMSE against this PNG at every power of two samples per pixel", cxxopts::value<luisa::string>()->default_value(""), "<png>");
+    cli.add_option("", "", "accumulation", "Accumulation format, mean, sum, half, kahan or double-float", cxxopts::value<luisa::string>()->default_value("mean"), "<format>");
+    cli.add_option("", "", "bvh-width", "BVH node width, 2, 4 or 8", cxxopts::value<uint>()->default_value("2"), "<width>");
+    cli.add_option("", "", "max-depth", "Maximum number of rays traced per path", cxxopts::value<uint>()->default_value("50"), "<depth>");
+    cli.add_option("", "", "rr-depth", "Rays traced before Russian roulette may end a path, 0 to disable", cxxopts::value<uint>()->default_value("0"), "<depth>");
+    cli.add_option("", "", "spp-per-dispatch", "Samples per pixel rendered by one dispatch, 0 to pick from --dispatch-ms", cxxopts::value<uint>()->default_value("1"), "<spp>");
+    cli.add_option("", "", "dispatch-ms", "Target dispatch duration for --spp-per-dispatch 0", cxxopts::value<double>()->default_value("100"), "<ms>");
+    cli.add_option("", "", "progress-interval", "Dispatches between progress reports", cxxopts::value<uint>()->default_value("1"), "<dispatches>");
+    cli.add_option("", "", "no-nee", "Only find lights by scattering, without sampling them directly", cxxopts::value<bool>()->default_value("false"), "");
+    cli.add_option("", "", "adaptive-threshold", "Stop sampling pixels whose relative error is below this, 0 to sample all", cxxopts::value<float>()->default_value("0"), "<error>");
+    cli.add_option("", "", "noise-target", "Stop rendering once the mean relative pixel error is below this, 0 to disable", cxxopts::value<float>()->default_value("0"), "<error>");
+    cli.add_option("", "", "min-samples", "Samples per pixel before adaptive sampling may stop a pixel", cxxopts::value<uint>()->default_value("16"), "<spp>");
+    cli.add_option("", "", "tile-size", "Render tiles of this many pixels square into <outfile>.ppm, 0 for the whole image at once", cxxopts::value<uint>()->default_value("0"), "<pixels>");
+    cli.add_option("", "", "time-limit", "Render until this many seconds have passed, unbounded by --samples unless given", cxxopts::value<double>()->default_value("0"), "<seconds>");
+    cli.add_option("", "", "checkpoint-interval", "Write the image so far every this many seconds", cxxopts::value<double>()->default_value("0"), "<seconds>");
+    cli.add_option("", "", "wavefront", "Render with separate generate, intersect, shade and accumulate kernels", cxxopts::value<bool>()->default_value("false"), "");
+    cli.add_option("", "", "sort-rays", "Sort the wavefront queues by material, origin cell and direction octant", cxxopts::value<bool>()->default_value("false"), "");
+    cli.add_option("", "", "stats", "Count traversal work per pixel and write heatmaps next to the image", cxxopts::value<bool>()->default_value("false"), "");
+    cli.add_option("", "", "bench-bvh-build", "Time the SAH builder on 1k to 10M random spheres and exit", cxxopts::value<bool>()->default_value("false"), "");
+    cli.add_option("", "", "check-scene-features", "Check the features detected in scenes 1, 2, 7 and 8 and in wrapped moving spheres, and exit", cxxopts::value<bool>()->default_value("false"), "");
+    cli.add_option("", "", "check-accumulation", "Check that Kahan and double-float accumulation differ from a plain sum and match the exact mean, and exit", cxxopts::value<bool>()->default_value("false"), "");
+    cli.add_option("", "", "bench-refit", "Move 100k spheres for 30 frames, comparing BVH refits against rebuilds, and exit", cxxopts::value<bool>()->default_value("false"), "");
+    cli.add_option("", "", "bench-traversal", "Time closest-hit traversal of final_scene with the per-axis, division and reciprocal slab tests, at each BVH width, and exit", cxxopts::value<bool>()->default_value("false"), "");
+    cli.add_option("", "", "bench-sampling", "Time the rejection and closed-form sphere, disk and hemisphere samplers and exit", cxxopts::value<bool>()->default_value("false"), "");
     cli.add_option("", "o", "outfile", "output image file name", cxxopts::value<luisa::string>()->default_value("./test"), "<image_name>");
 
     const cxxopts::ParseResult options = [&] {